@@ -0,0 +1,495 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../huffman.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define USAGE \
+    "usage: ./bench [-f json|csv] [-s size] [-m seconds] [file ...]\n" \
+    "       files are benchmarked along with the generated corpus\n"
+
+#define DEFAULT_SIZE (8 << 20)
+#define DEFAULT_SECONDS 0.3
+#define MESSAGE_COUNT 5000 // per size of the latency runs
+
+typedef struct {
+    const char* name;
+    uchar* data;
+    size_t size;
+} sample;
+
+typedef struct {
+    const char* corpus;
+    const char* mode;
+    size_t size;
+    size_t compressed;
+    double compress_mbps;
+    double decompress_mbps;
+} throughput_result;
+
+typedef struct {
+    const char* corpus;
+    const char* operation;
+    size_t size;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double max_us;
+} latency_result;
+
+/* ============= corpus =============== */
+
+static uint64_t random_state = 88172645463325252ull;
+
+// xorshift, so the corpus is the same on every platform
+static uint next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (uint) (random_state >> 32);
+}
+
+
+static const char* words[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as",
+    "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+    "his", "from", "at", "which", "but", "have", "an", "had", "they",
+    "you", "were", "their", "one", "all", "we", "can", "her", "has",
+    "there", "been", "if", "more", "when", "will", "would", "who", "so",
+    "compression", "huffman", "symbol", "frequency", "table", "stream"
+};
+
+
+static void generate_text(uchar* data, size_t size) {
+    size_t count = sizeof(words) / sizeof(words[0]), i = 0;
+    while(i < size) {
+        // small indices are taken more often, like in a natural language
+        uint r = next_random();
+        const char* word = words[(r % count) * ((r >> 16) % count) / count];
+        for(; *word && i < size; ++word) {
+            data[i++] = (uchar) *word;
+        }
+        if(i < size) {
+            r = next_random() % 16;
+            data[i++] = r == 0 ? '\n' : r == 1 ? ',' : r == 2 ? '.' : ' ';
+        }
+    }
+}
+
+
+static void generate_logs(uchar* data, size_t size) {
+    static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN",
+        "ERROR" };
+    static const char* paths[] = { "/api/v1/users", "/api/v1/orders",
+        "/health", "/static/app.js", "/api/v1/search" };
+    char line[256];
+    size_t i = 0;
+    uint seconds = 0;
+    while(i < size) {
+        seconds += next_random() % 3;
+        int length = snprintf(line, sizeof(line),
+                "2024-05-01T%02u:%02u:%02u.%03uZ %-5s [worker-%u] GET %s "
+                "status=%u took=%ums id=%08x\n",
+                seconds / 3600 % 24, seconds / 60 % 60, seconds % 60,
+                next_random() % 1000, levels[next_random() % 6],
+                next_random() % 8, paths[next_random() % 5],
+                next_random() % 10 ? 200 : 404, next_random() % 250,
+                next_random());
+        for(int k = 0; k < length && i < size; ++k) {
+            data[i++] = (uchar) line[k];
+        }
+    }
+}
+
+
+// records of an increasing id, a small signed delta and a flags byte
+static void generate_binary(uchar* data, size_t size) {
+    uint id = 1000;
+    for(size_t i = 0; i < size; ++i) {
+        size_t field = i % 8;
+        if(field == 0) {
+            id += 1 + next_random() % 4;
+        }
+        data[i] = field < 4 ? (uchar) (id >> (8 * field)) :
+            field < 6 ? (uchar) ((int) (next_random() % 64) - 32) :
+            field == 6 ? (uchar) (next_random() % 4) : 0;
+    }
+}
+
+
+static void generate_random(uchar* data, size_t size) {
+    for(size_t i = 0; i < size; ++i) {
+        data[i] = (uchar) next_random();
+    }
+}
+
+
+static void generate_runs(uchar* data, size_t size) {
+    size_t i = 0;
+    while(i < size) {
+        uchar value = (uchar) (next_random() % 4);
+        size_t run = 1 + next_random() % 200;
+        for(; run && i < size; --run) {
+            data[i++] = value;
+        }
+    }
+}
+
+
+// geometric distribution, every next byte is half as frequent
+static void generate_skewed(uchar* data, size_t size) {
+    for(size_t i = 0; i < size; ++i) {
+        uint r = next_random();
+        uchar value = 0;
+        while((r & 1) && value < 30) {
+            value++;
+            r >>= 1;
+        }
+        data[i] = value;
+    }
+}
+
+
+static int read_sample(const char* path, sample* file) {
+    FILE* input = fopen(path, "rb");
+    if(!input) {
+        return 0;
+    }
+    fseek(input, 0, SEEK_END);
+    long size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    file->size = size > 0 ? (size_t) size : 0;
+    file->data = (uchar*) malloc(file->size ? file->size : 1);
+    size_t read = fread(file->data, 1, file->size, input);
+    fclose(input);
+
+    const char* name = strrchr(path, '/');
+    file->name = name ? name + 1 : path;
+    return read == file->size && file->size > 0;
+}
+
+/* ============= measurements =============== */
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+
+// runs are repeated for at least the given time, the fastest one counts
+static int measure_throughput(sample* corpus, const char* mode,
+        const huffman_options* options, double seconds,
+        throughput_result* result) {
+    size_t bound = huffman_compress_bound(corpus->size), compressed, size;
+    uchar* output = (uchar*) malloc(bound);
+    uchar* restored = (uchar*) malloc(corpus->size);
+    double best_compress = 1e30, best_decompress = 1e30, start;
+    int success = 1;
+
+    start = now();
+    for(int run = 0; run < 3 || now() - start < seconds; ++run) {
+        double time = now();
+        success &= huffman_compress_to(corpus->data, corpus->size, output,
+                bound, &compressed, options);
+        time = now() - time;
+        best_compress = time < best_compress ? time : best_compress;
+    }
+
+    start = now();
+    for(int run = 0; run < 3 || now() - start < seconds; ++run) {
+        double time = now();
+        success &= huffman_decompress_to(output, compressed, restored,
+                corpus->size, &size);
+        time = now() - time;
+        best_decompress = time < best_decompress ? time : best_decompress;
+    }
+    success &= size == corpus->size &&
+        memcmp(corpus->data, restored, size) == 0;
+
+    result->corpus = corpus->name;
+    result->mode = mode;
+    result->size = corpus->size;
+    result->compressed = compressed;
+    result->compress_mbps = corpus->size / 1e6 / best_compress;
+    result->decompress_mbps = corpus->size / 1e6 / best_decompress;
+    free(output);
+    free(restored);
+    return success;
+}
+
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+
+static void percentiles(double* times, const char* corpus,
+        const char* operation, size_t size, latency_result* result) {
+    qsort(times, MESSAGE_COUNT, sizeof(double), compare_double);
+    result->corpus = corpus;
+    result->operation = operation;
+    result->size = size;
+    result->p50_us = times[MESSAGE_COUNT / 2] * 1e6;
+    result->p90_us = times[MESSAGE_COUNT * 9 / 10] * 1e6;
+    result->p99_us = times[MESSAGE_COUNT * 99 / 100] * 1e6;
+    result->max_us = times[MESSAGE_COUNT - 1] * 1e6;
+}
+
+
+// small messages are taken at random offsets of the corpus and
+// coded one by one, as a service would do
+static int measure_latency(sample* corpus, size_t size,
+        latency_result* compress, latency_result* decompress) {
+    size_t bound = huffman_compress_bound(size), compressed, restored_size;
+    uchar* output = (uchar*) malloc(bound);
+    uchar* restored = (uchar*) malloc(size);
+    double* compress_times = (double*) malloc(MESSAGE_COUNT *
+            sizeof(double));
+    double* decompress_times = (double*) malloc(MESSAGE_COUNT *
+            sizeof(double));
+    int success = 1;
+
+    for(int i = 0; i < MESSAGE_COUNT; ++i) {
+        uchar* message = corpus->data +
+            next_random() % (corpus->size - size + 1);
+        double time = now();
+        success &= huffman_compress_to(message, size, output, bound,
+                &compressed, NULL);
+        compress_times[i] = now() - time;
+
+        time = now();
+        success &= huffman_decompress_to(output, compressed, restored,
+                size, &restored_size);
+        decompress_times[i] = now() - time;
+        success &= memcmp(message, restored, size) == 0;
+    }
+
+    percentiles(compress_times, corpus->name, "compress", size, compress);
+    percentiles(decompress_times, corpus->name, "decompress", size,
+            decompress);
+    free(output);
+    free(restored);
+    free(compress_times);
+    free(decompress_times);
+    return success;
+}
+
+// MESSAGE_COUNT records of the given size at random offsets of the
+// corpus in one call of the batch API
+static int measure_batch(sample* corpus, size_t size, const char* mode,
+        const huffman_options* options, double seconds,
+        throughput_result* result) {
+    uchar** records = (uchar**) malloc(MESSAGE_COUNT * sizeof(uchar*));
+    size_t* sizes = (size_t*) malloc(MESSAGE_COUNT * sizeof(size_t));
+    size_t* offsets = (size_t*) malloc((MESSAGE_COUNT + 1) * sizeof(size_t));
+    size_t* restored_offsets =
+        (size_t*) malloc((MESSAGE_COUNT + 1) * sizeof(size_t));
+    for(int i = 0; i < MESSAGE_COUNT; ++i) {
+        records[i] = corpus->data + next_random() % (corpus->size - size + 1);
+        sizes[i] = size;
+    }
+    size_t total = MESSAGE_COUNT * size;
+    size_t bound = huffman_compress_batch_bound(sizes, MESSAGE_COUNT);
+    uchar* output = (uchar*) malloc(bound);
+    uchar* restored = (uchar*) malloc(total);
+    double best_compress = 1e30, best_decompress = 1e30, start;
+    int success = 1;
+
+    start = now();
+    for(int run = 0; run < 3 || now() - start < seconds; ++run) {
+        double time = now();
+        success &= huffman_compress_batch(records, sizes, MESSAGE_COUNT,
+                output, bound, offsets, options);
+        time = now() - time;
+        best_compress = time < best_compress ? time : best_compress;
+    }
+
+    start = now();
+    for(int run = 0; run < 3 || now() - start < seconds; ++run) {
+        double time = now();
+        success &= huffman_decompress_batch(output, offsets, MESSAGE_COUNT,
+                restored, total, restored_offsets);
+        time = now() - time;
+        best_decompress = time < best_decompress ? time : best_decompress;
+    }
+    for(int i = 0; i < MESSAGE_COUNT; ++i) {
+        success &= memcmp(records[i], restored + restored_offsets[i],
+                size) == 0;
+    }
+
+    result->corpus = corpus->name;
+    result->mode = mode;
+    result->size = total;
+    result->compressed = offsets[MESSAGE_COUNT];
+    result->compress_mbps = total / 1e6 / best_compress;
+    result->decompress_mbps = total / 1e6 / best_decompress;
+    free(records);
+    free(sizes);
+    free(offsets);
+    free(restored_offsets);
+    free(output);
+    free(restored);
+    return success;
+}
+
+/* ============= output =============== */
+
+static void print_json(throughput_result* throughput, int throughput_count,
+        latency_result* latency, int latency_count) {
+    printf("{\n  \"kernels\": \"%s\",\n  \"throughput\": [\n",
+            huffman_kernels());
+    for(int i = 0; i < throughput_count; ++i) {
+        throughput_result* r = throughput + i;
+        printf("    {\"corpus\": \"%s\", \"mode\": \"%s\", \"size\": %zu, "
+                "\"compressed\": %zu, \"ratio\": %.4f, "
+                "\"compress_mbps\": %.1f, \"decompress_mbps\": %.1f}%s\n",
+                r->corpus, r->mode, r->size, r->compressed,
+                (double) r->compressed / r->size, r->compress_mbps,
+                r->decompress_mbps, i + 1 < throughput_count ? "," : "");
+    }
+    printf("  ],\n  \"latency\": [\n");
+    for(int i = 0; i < latency_count; ++i) {
+        latency_result* r = latency + i;
+        printf("    {\"corpus\": \"%s\", \"operation\": \"%s\", "
+                "\"size\": %zu, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+                "\"p99_us\": %.2f, \"max_us\": %.2f}%s\n",
+                r->corpus, r->operation, r->size, r->p50_us, r->p90_us,
+                r->p99_us, r->max_us, i + 1 < latency_count ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+
+// one table, the columns which don't apply to a row are empty
+static void print_csv(throughput_result* throughput, int throughput_count,
+        latency_result* latency, int latency_count) {
+    printf("kind,corpus,mode,size,compressed,ratio,compress_mbps,"
+            "decompress_mbps,p50_us,p90_us,p99_us,max_us\n");
+    for(int i = 0; i < throughput_count; ++i) {
+        throughput_result* r = throughput + i;
+        printf("throughput,%s,%s,%zu,%zu,%.4f,%.1f,%.1f,,,,\n", r->corpus,
+                r->mode, r->size, r->compressed,
+                (double) r->compressed / r->size, r->compress_mbps,
+                r->decompress_mbps);
+    }
+    for(int i = 0; i < latency_count; ++i) {
+        latency_result* r = latency + i;
+        printf("latency,%s,%s,%zu,,,,,%.2f,%.2f,%.2f,%.2f\n", r->corpus,
+                r->operation, r->size, r->p50_us, r->p90_us, r->p99_us,
+                r->max_us);
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    size_t size = DEFAULT_SIZE;
+    double seconds = DEFAULT_SECONDS;
+    int csv = 0, arg = 1;
+
+    for(; arg < argc && argv[arg][0] == '-'; ++arg) {
+        if(strcmp(argv[arg], "-f") == 0 && arg + 1 < argc) {
+            csv = strcmp(argv[++arg], "csv") == 0;
+            if(!csv && strcmp(argv[arg], "json") != 0) {
+                fprintf(stderr, "bad format: %s\n", argv[arg]);
+                return 1;
+            }
+        } else if(strcmp(argv[arg], "-s") == 0 && arg + 1 < argc) {
+            size = (size_t) atol(argv[++arg]);
+            if(size < 4096) {
+                fprintf(stderr, "bad size: %s\n", argv[arg]);
+                return 1;
+            }
+        } else if(strcmp(argv[arg], "-m") == 0 && arg + 1 < argc) {
+            seconds = atof(argv[++arg]);
+        } else {
+            fprintf(stderr, "bad option: %s\n", argv[arg]);
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+
+    static const struct {
+        const char* name;
+        void (*generate)(uchar* data, size_t size);
+    } generators[] = {
+        { "text", generate_text },
+        { "logs", generate_logs },
+        { "binary", generate_binary },
+        { "random", generate_random },
+        { "runs", generate_runs },
+        { "skewed", generate_skewed }
+    };
+    int generated = sizeof(generators) / sizeof(generators[0]);
+    int corpus_count = generated + argc - arg;
+    sample* corpus = (sample*) calloc(corpus_count, sizeof(sample));
+    for(int i = 0; i < generated; ++i) {
+        corpus[i].name = generators[i].name;
+        corpus[i].size = size;
+        corpus[i].data = (uchar*) malloc(size);
+        generators[i].generate(corpus[i].data, size);
+    }
+    for(int i = generated; i < corpus_count; ++i) {
+        if(!read_sample(argv[arg + i - generated], corpus + i)) {
+            fprintf(stderr, "can't read %s\n", argv[arg + i - generated]);
+            return 1;
+        }
+    }
+
+    huffman_options single, interleaved;
+    huffman_default_options(&single);
+    huffman_default_options(&interleaved);
+    interleaved.interleaved = 1;
+    huffman_options shared;
+    huffman_default_options(&shared);
+    shared.batch_table = 1;
+
+    static const size_t message_sizes[] = { 256, 1024, 4096 };
+    int message_size_count = sizeof(message_sizes) / sizeof(size_t);
+    throughput_result* throughput = (throughput_result*)
+        malloc((2 * corpus_count + 4) * sizeof(throughput_result));
+    latency_result* latency = (latency_result*)
+        malloc(2 * message_size_count * 2 * sizeof(latency_result));
+    int throughput_count = 0, latency_count = 0, success = 1;
+
+    for(int i = 0; i < corpus_count; ++i) {
+        success &= measure_throughput(corpus + i, "single", &single, seconds,
+                throughput + throughput_count++);
+        success &= measure_throughput(corpus + i, "interleaved",
+                &interleaved, seconds, throughput + throughput_count++);
+    }
+    // small messages of the structured kinds, text and logs
+    for(int i = 0; i < 2; ++i) {
+        for(int k = 0; k < message_size_count; ++k) {
+            success &= measure_latency(corpus + i, message_sizes[k],
+                    latency + latency_count, latency + latency_count + 1);
+            latency_count += 2;
+        }
+        // 1 KB records of a batch, each with its own code and sharing one
+        success &= measure_batch(corpus + i, 1024, "batch", &single,
+                seconds, throughput + throughput_count++);
+        success &= measure_batch(corpus + i, 1024, "batch_table", &shared,
+                seconds, throughput + throughput_count++);
+    }
+
+    if(csv) {
+        print_csv(throughput, throughput_count, latency, latency_count);
+    } else {
+        print_json(throughput, throughput_count, latency, latency_count);
+    }
+
+    for(int i = 0; i < corpus_count; ++i) {
+        free(corpus[i].data);
+    }
+    free(corpus);
+    free(throughput);
+    free(latency);
+    if(!success) {
+        fprintf(stderr, "data recovered incorrectly\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "block_index.h"
+#include "stream.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+/* =========== public functions ============ */
+
+void block_index_add(block_index* index, size_t size, size_t compressed) {
+    if(index->count == index->capacity) {
+        index->capacity = index->capacity ? 2 * index->capacity : 64;
+        index->sizes = (uint*) realloc(index->sizes,
+                2 * index->capacity * sizeof(uint));
+    }
+    index->sizes[2 * index->count] = (uint) size;
+    index->sizes[2 * index->count + 1] = (uint) compressed;
+    index->count++;
+}
+
+
+void block_index_free(block_index* index) {
+    free(index->sizes);
+    index->sizes = NULL;
+    index->count = index->capacity = 0;
+}
+
+
+size_t block_index_size(size_t count) {
+    return count * BLOCK_INDEX_ENTRY_SIZE + BLOCK_INDEX_FOOTER_SIZE;
+}
+
+
+void block_index_store(const block_index* index, uchar* output) {
+    for(size_t i = 0; i < 2 * index->count; ++i) {
+        stream_store_le(output + 4 * i, index->sizes[i], 4);
+    }
+    output += index->count * BLOCK_INDEX_ENTRY_SIZE;
+    stream_store_le(output, index->count, 8);
+    stream_store_le(output + 8, BLOCK_INDEX_MAGIC, 4);
+}
+
+
+int block_index_write(const block_index* index, huffman_write_fn write,
+        void* opaque) {
+    size_t size = block_index_size(index->count);
+    uchar* data = (uchar*) malloc(size);
+    if(!data) {
+        return 0;
+    }
+    block_index_store(index, data);
+    int success = write(opaque, data, size);
+    free(data);
+    return success;
+}
+
+
+int block_index_find(const uchar* input, size_t insize, size_t* count) {
+    if(insize < BLOCK_INDEX_FOOTER_SIZE) {
+        return 0;
+    }
+    const uchar* footer = input + insize - BLOCK_INDEX_FOOTER_SIZE;
+    uint64_t stored = stream_load_le(footer, 8);
+    if(stream_load_le(footer + 8, 4) != BLOCK_INDEX_MAGIC ||
+            stored > (insize - BLOCK_INDEX_FOOTER_SIZE) /
+            BLOCK_INDEX_ENTRY_SIZE) {
+        return 0;
+    }
+    *count = (size_t) stored;
+    return 1;
+}
+
+
+int block_index_valid(const uchar* data, size_t size, size_t count) {
+    size_t stored;
+    return size == block_index_size(count) &&
+        block_index_find(data, size, &stored) && stored == count;
+}
@@ -0,0 +1,40 @@
+#ifndef BLOCK_INDEX_H
+#define BLOCK_INDEX_H
+
+#include "huffman.h"
+
+/* Index of a seekable stream follows its end marker: the data size and
+ * the compressed size of every block (4-byte little endian numbers),
+ * then the 8-byte count of the blocks and the 4-byte magic number, so
+ * the index is found from the end of the stream. */
+
+#define BLOCK_INDEX_ENTRY_SIZE 8
+#define BLOCK_INDEX_FOOTER_SIZE 12
+#define BLOCK_INDEX_MAGIC 0x58444948 // "HIDX"
+
+typedef struct {
+    uint* sizes; // data size and compressed size of every block
+    size_t count;
+    size_t capacity;
+} block_index;
+
+void block_index_add(block_index* index, size_t size, size_t compressed);
+
+void block_index_free(block_index* index);
+
+// size of the index of count blocks
+size_t block_index_size(size_t count);
+
+void block_index_store(const block_index* index, uchar* output);
+
+int block_index_write(const block_index* index, huffman_write_fn write,
+        void* opaque);
+
+// finds the index at the end of the stream and the count of its blocks,
+// returns 0 if there's no index
+int block_index_find(const uchar* input, size_t insize, size_t* count);
+
+// whether the data is exactly the index of count blocks
+int block_index_valid(const uchar* data, size_t size, size_t count);
+
+#endif
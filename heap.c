@@ -1,5 +1,6 @@
 #include "heap.h"
 #include <stdlib.h>
+#include <string.h>
 
 /* ============= helpers =============== */
 
@@ -100,3 +101,133 @@ char heap_empty(binary_heap* heap) {
 char heap_full(binary_heap* heap) {
     return heap->size == heap->capacity;
 }
+
+
+/* ============= value heap =============== */
+
+static char* heap_element(value_heap* heap, int n) {
+    return heap->buffer + n * heap->element_size;
+}
+
+
+// the spare element past the capacity holds the one being sifted
+static void value_sift_up(value_heap* heap, int n) {
+    char* item = heap_element(heap, heap->capacity);
+    while(n > 0) {
+        int parent = (n - 1) / heap->arity;
+        if(heap->cmp(item, heap_element(heap, parent)) >= 0) {
+            break;
+        }
+        memcpy(heap_element(heap, n), heap_element(heap, parent),
+                heap->element_size);
+        n = parent;
+    }
+    memcpy(heap_element(heap, n), item, heap->element_size);
+}
+
+
+static void value_sift_down(value_heap* heap, int n) {
+    char* item = heap_element(heap, heap->capacity);
+    for(;;) {
+        int first = n * heap->arity + 1, best = first;
+        if(first >= heap->size) {
+            break;
+        }
+        int end = heap->size - first > heap->arity ?
+            first + heap->arity : heap->size;
+        for(int child = first + 1; child < end; ++child) {
+            if(heap->cmp(heap_element(heap, child),
+                        heap_element(heap, best)) < 0) {
+                best = child;
+            }
+        }
+        if(heap->cmp(heap_element(heap, best), item) >= 0) {
+            break;
+        }
+        memcpy(heap_element(heap, n), heap_element(heap, best),
+                heap->element_size);
+        n = best;
+    }
+    memcpy(heap_element(heap, n), item, heap->element_size);
+}
+
+
+value_heap* value_heap_create(int elements_count, size_t element_size,
+        int arity, int (*cmp_f)(const void* arg1, const void* arg2)) {
+    if(elements_count < 0 || element_size == 0 || arity < 2 || !cmp_f) {
+        return NULL;
+    }
+
+    value_heap* heap = malloc(sizeof(value_heap));
+    heap->buffer = malloc(element_size * (elements_count + 1));
+    heap->element_size = element_size;
+    heap->size = 0;
+    heap->capacity = elements_count;
+    heap->arity = arity;
+    heap->cmp = cmp_f;
+
+    return heap;
+}
+
+
+void value_heap_destroy(value_heap* heap) {
+    free(heap->buffer);
+    free(heap);
+}
+
+
+char value_heap_insert(value_heap* heap, const void* data) {
+    if(heap->size == heap->capacity)
+        return 0;
+
+    memcpy(heap_element(heap, heap->capacity), data, heap->element_size);
+    value_sift_up(heap, heap->size++);
+    return 1;
+}
+
+
+char value_heap_pop(value_heap* heap, void* data) {
+    if(heap->size == 0)
+        return 0;
+
+    memcpy(data, heap_element(heap, 0), heap->element_size);
+    if(--heap->size > 0) { // the last element sinks from the top
+        memcpy(heap_element(heap, heap->capacity),
+                heap_element(heap, heap->size), heap->element_size);
+        value_sift_down(heap, 0);
+    }
+    return 1;
+}
+
+
+const void* value_heap_top(value_heap* heap) {
+    return heap->size ? heap_element(heap, 0) : NULL;
+}
+
+
+char value_heap_replace_top(value_heap* heap, const void* data, void* top) {
+    if(heap->size == 0)
+        return 0;
+
+    memcpy(top, heap_element(heap, 0), heap->element_size);
+    memcpy(heap_element(heap, heap->capacity), data, heap->element_size);
+    value_sift_down(heap, 0);
+    return 1;
+}
+
+
+char value_heap_build(value_heap* heap, const void* data, int count) {
+    if(count > heap->capacity)
+        return 0;
+
+    if(count > 0)
+        memcpy(heap->buffer, data, count * heap->element_size);
+    heap->size = count;
+    // every parent sinks into its already built subtrees, from the last
+    for(int n = (count - 2) / heap->arity; count > 1 && n >= 0; --n) {
+        memcpy(heap_element(heap, heap->capacity), heap_element(heap, n),
+                heap->element_size);
+        value_sift_down(heap, n);
+    }
+    return 1;
+}
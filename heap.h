@@ -1,6 +1,10 @@
 #ifndef HEAP_H
 #define HEAP_H
 
+#include <stddef.h>
+
+#define HEAP_DEFAULT_ARITY 4
+
 typedef struct {
     void** buffer;
     int size;
@@ -21,4 +25,121 @@ char heap_empty(binary_heap* heap);
 
 char heap_full(binary_heap* heap);
 
+/* Value heap keeps the elements themselves in one buffer, so there's no
+ * pointer to follow per comparison. Every node has `arity` children, which
+ * makes the tree shallower and keeps the children of a node together. */
+
+typedef struct {
+    char* buffer;        // capacity elements and one spare for sifting
+    size_t element_size;
+    int size;
+    int capacity;
+    int arity;
+    int (*cmp)(const void* arg1, const void* arg2);
+} value_heap;
+
+value_heap* value_heap_create(int elements_count, size_t element_size,
+        int arity, int (*cmp_f)(const void* arg1, const void* arg2));
+
+void value_heap_destroy(value_heap* heap);
+
+char value_heap_insert(value_heap* heap, const void* element);
+
+// copies the smallest element out and removes it
+char value_heap_pop(value_heap* heap, void* element);
+
+const void* value_heap_top(value_heap* heap);
+
+// pop and insert at once: the top is copied out and the new element
+// takes its place with a single sift down
+char value_heap_replace_top(value_heap* heap, const void* element,
+        void* top);
+
+// replaces the contents with count elements in O(count)
+char value_heap_build(value_heap* heap, const void* elements, int count);
+
+/* Typed heap over an array of the caller, defined with
+ * HEAP_DEFINE(name, type, arity, less). less(a, b) takes two values and
+ * is expanded in place, so the comparison is inlined. It defines the type
+ * `name` and the functions name_init, name_push, name_pop, name_top,
+ * name_replace_top and name_build. */
+
+#define HEAP_DEFINE(name, type, arity, less) \
+typedef struct { \
+    type* items; \
+    int size; \
+    int capacity; \
+} name; \
+\
+static inline void name##_init(name* heap, type* items, int capacity) { \
+    heap->items = items; \
+    heap->size = 0; \
+    heap->capacity = capacity; \
+} \
+\
+static inline void name##_sift_up(name* heap, int n, type item) { \
+    while(n > 0 && less(item, heap->items[(n - 1) / (arity)])) { \
+        heap->items[n] = heap->items[(n - 1) / (arity)]; \
+        n = (n - 1) / (arity); \
+    } \
+    heap->items[n] = item; \
+} \
+\
+static inline void name##_sift_down(name* heap, int n, type item) { \
+    for(;;) { \
+        int first = n * (arity) + 1, best = first; \
+        if(first >= heap->size) { \
+            break; \
+        } \
+        int end = heap->size - first > (arity) ? \
+            first + (arity) : heap->size; \
+        for(int child = first + 1; child < end; ++child) { \
+            if(less(heap->items[child], heap->items[best])) { \
+                best = child; \
+            } \
+        } \
+        if(!less(heap->items[best], item)) { \
+            break; \
+        } \
+        heap->items[n] = heap->items[best]; \
+        n = best; \
+    } \
+    heap->items[n] = item; \
+} \
+\
+static inline char name##_push(name* heap, type item) { \
+    if(heap->size == heap->capacity) { \
+        return 0; \
+    } \
+    name##_sift_up(heap, heap->size++, item); \
+    return 1; \
+} \
+\
+/* the heap must not be empty */ \
+static inline type name##_top(name* heap) { \
+    return heap->items[0]; \
+} \
+\
+static inline type name##_pop(name* heap) { \
+    type top = heap->items[0]; \
+    if(--heap->size > 0) { \
+        name##_sift_down(heap, 0, heap->items[heap->size]); \
+    } \
+    return top; \
+} \
+\
+static inline type name##_replace_top(name* heap, type item) { \
+    type top = heap->items[0]; \
+    name##_sift_down(heap, 0, item); \
+    return top; \
+} \
+\
+/* makes a heap of the first size items already in the array */ \
+static inline void name##_build(name* heap, int size) { \
+    heap->size = size; \
+    for(int n = (size - 2) / (arity); size > 1 && n >= 0; --n) { \
+        name##_sift_down(heap, n, heap->items[n]); \
+    } \
+}
+
 #endif
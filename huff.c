@@ -1,150 +1,329 @@
+#define _POSIX_C_SOURCE 200809L
 #include "huffman.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define uchar unsigned char
 
-char compress_file(const char* infile_name, const char* outfile_name);
-char decompress_file(const char* infile_name, const char* outfile_name);
+#define USAGE \
+    "usage: ./huff [-c|-d] [-t threads] [-p] [-s] [-o tables] " \
+    "[-r offset:size] infile_name outfile_name\n" \
+    "       - for infile_name or outfile_name is stdin or stdout\n" \
+    "       -s compresses into a seekable file, -r decompresses a range " \
+    "of it\n" \
+    "       -o codes every byte by one of 2..8 tables picked by the " \
+    "previous one\n"
+
+char compress_file(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, char pipelined);
+char decompress_file(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, char pipelined);
+char decompress_range_file(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, size_t offset, size_t size);
 
 int main(int argc, char* argv[]) {
-    char operation = 0, success = 0;
-    char* infile_name, *outfile_name;
+    char operation = 0, success = 0, pipelined = 0, ranged = 0;
+    size_t offset = 0, size = 0;
+    huffman_options options;
+    huffman_default_options(&options);
+
     if(argc < 2) {
-        printf("usage: ./huff [-c|-d] infile_name [outfile_name]\n");
+        fprintf(stderr, USAGE);
         return 1;
     }
-    switch(argc) {
-        case 2:
-            printf("no infile_name specified\n");
-        case 3:
-            printf("no outfile_name specified\n");
-            return 1;
-        default:
-            if(strcmp(argv[1], "-c") == 0)
-                operation = 1;
-            else if(strcmp(argv[1], "-d") == 0)
-                operation = 2;
-            else {
-                printf("bad option: %s\n", argv[1]);
-                printf("usage: ./huff [-c|-d] infile_name [outfile_name]\n");
+    if(strcmp(argv[1], "-c") == 0)
+        operation = 1;
+    else if(strcmp(argv[1], "-d") == 0)
+        operation = 2;
+    else {
+        fprintf(stderr, "bad option: %s\n", argv[1]);
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+
+    int arg = 2;
+    for(; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg) {
+        if(strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            options.threads = atoi(argv[++arg]);
+            if(options.threads <= 0) {
+                fprintf(stderr, "bad thread count: %s\n", argv[arg]);
+                return 1;
+            }
+        } else if(strcmp(argv[arg], "-p") == 0) {
+            pipelined = 1;
+        } else if(strcmp(argv[arg], "-s") == 0) {
+            options.seekable = 1;
+        } else if(strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            options.context_tables = atoi(argv[++arg]);
+            if(options.context_tables < 2 ||
+                    options.context_tables > HUFFMAN_MAX_CONTEXT_TABLES) {
+                fprintf(stderr, "bad table count: %s\n", argv[arg]);
+                return 1;
+            }
+        } else if(strcmp(argv[arg], "-r") == 0 && arg + 1 < argc) {
+            char* end;
+            offset = (size_t) strtoull(argv[++arg], &end, 10);
+            ranged = *end == ':';
+            if(ranged) {
+                size = (size_t) strtoull(end + 1, &end, 10);
+            }
+            if(!ranged || *end || operation != 2) {
+                fprintf(stderr, "bad range: %s\n", argv[arg]);
                 return 1;
             }
+        } else {
+            fprintf(stderr, "bad option: %s\n", argv[arg]);
+            fprintf(stderr, USAGE);
+            return 1;
+        }
     }
 
-    infile_name = (char*) malloc(strlen(argv[2]));
-    strcpy(infile_name, argv[2]);
-    outfile_name = (char*) malloc(strlen(argv[3]));
-    strcpy(outfile_name, argv[3]);
+    if(argc - arg < 1) {
+        fprintf(stderr, "no infile_name specified\n");
+        return 1;
+    } else if(argc - arg < 2) {
+        fprintf(stderr, "no outfile_name specified\n");
+        return 1;
+    }
 
     switch(operation) {
     case 1:
-        success = compress_file(infile_name, outfile_name);
+        success = compress_file(argv[arg], argv[arg + 1], &options,
+                pipelined);
         break;
     case 2:
-        success = decompress_file(infile_name, outfile_name);
+        success = ranged ?
+            decompress_range_file(argv[arg], argv[arg + 1], &options,
+                    offset, size) :
+            decompress_file(argv[arg], argv[arg + 1], &options, pipelined);
         break;
     }
-    return 0;
+    return success ? 0 : 1;
+}
+
+typedef struct {
+    int fd;
+    uchar* data;
+    size_t size;
+} mapped_file;
+
+static int write_file(void* file, const uchar* data, size_t size) {
+    return fwrite(data, 1, size, (FILE*) file) == size;
 }
 
-char compress_file(const char* infile_name, const char* outfile_name) {
-    FILE* infile = fopen(infile_name, "r");
-    if(!infile) {
-        printf("infile not found\n");
+static int read_file(void* file, uchar* data, size_t size, size_t* read) {
+    *read = fread(data, 1, size, (FILE*) file);
+    return !ferror((FILE*) file);
+}
+
+// maps the whole input file for sequential reading, returns -1 if it
+// can't be opened and 0 if it can't be mapped (pipes, empty files)
+static int map_input(const char* name, mapped_file* file) {
+    struct stat info;
+    file->fd = open(name, O_RDONLY);
+    if(file->fd < 0) {
+        return -1;
+    }
+    if(fstat(file->fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+            info.st_size == 0) {
+        close(file->fd);
         return 0;
     }
-    fseek(infile, 0, SEEK_END);
-    int insize = ftell(infile), outsize = 0;
 
-    if(insize == 0) {
-        printf("input file is empty\n");
+    file->size = info.st_size;
+    file->data = (uchar*) mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+            file->fd, 0);
+    if(file->data == MAP_FAILED) {
+        close(file->fd);
         return 0;
     }
+    posix_madvise(file->data, file->size, POSIX_MADV_SEQUENTIAL);
+    return 1;
+}
 
-    fclose(infile);
-    infile = fopen(infile_name, "r");
-
-    uchar* input = (uchar*) malloc(insize);
-    if(fread(input, 1, insize, infile) != insize) {
-        printf("input file reading failure\n");
+// creates the output file of the given size and maps it, the blocks
+// are reserved so that a full disk fails here and not on a page write
+static int map_output(const char* name, size_t size, mapped_file* file) {
+    file->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    file->size = size;
+    file->data = NULL;
+    if(file->fd < 0) {
         return 0;
     }
-
-    uchar* output = huffman_compress(input, insize, &outsize);
-
-    if(!output) {
-        printf("compression error\n");
+    if(size == 0) {
+        return 1;
+    }
+    if(posix_fallocate(file->fd, 0, size) != 0) {
+        close(file->fd);
         return 0;
     }
-
-    free(input);
-    fclose(infile);
-
-    FILE* outfile = fopen(outfile_name, "w");
-
-    if(fwrite(output, 1, outsize, outfile) != outsize) {
-        printf("output file writting failure\n");
+    file->data = (uchar*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            file->fd, 0);
+    if(file->data == MAP_FAILED) {
+        close(file->fd);
         return 0;
     }
-
-    free(output);
-    fclose(outfile);
     return 1;
 }
 
-char decompress_file(const char* infile_name, const char* outfile_name) {
-    FILE* infile = fopen(infile_name, "r");
-    if(!infile) {
-        printf("infile not found\n");
-        return 0;
+// unmaps the output and cuts it to the size actually written
+static int close_output(mapped_file* file, size_t size) {
+    int success = 1;
+    if(file->data) {
+        success = munmap(file->data, file->size) == 0;
+    }
+    if(size < file->size) {
+        success = ftruncate(file->fd, size) == 0 && success;
     }
-    fseek(infile, 0, SEEK_END);
-    int insize = ftell(infile), outsize = 0;
+    return close(file->fd) == 0 && success;
+}
 
-    if(insize == 0) {
-        printf("input file is empty\n");
+static void close_input(mapped_file* file) {
+    munmap(file->data, file->size);
+    close(file->fd);
+}
+
+// copies of the data are made by neither side when the files are mapped
+static char transcode_files(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, char compress, char pipelined) {
+    mapped_file input, output;
+    // standard streams are pipes as often as not
+    char stdin_input = strcmp(infile_name, "-") == 0;
+    char stdout_output = strcmp(outfile_name, "-") == 0;
+    int mapped = pipelined || stdin_input || stdout_output ?
+        0 : map_input(infile_name, &input);
+    if(mapped < 0) {
+        fprintf(stderr, "infile not found\n");
         return 0;
     }
 
-    fclose(infile);
-    infile = fopen(infile_name, "r");
+    // reading, coding and writing at once
+    if(!mapped) {
+        FILE* infile = stdin_input ? stdin : fopen(infile_name, "rb");
+        FILE* outfile = !infile ? NULL :
+            stdout_output ? stdout : fopen(outfile_name, "wb");
+        if(!outfile) {
+            fprintf(stderr, infile ? "output file opening failure\n" :
+                    "infile not found\n");
+            if(infile && !stdin_input) {
+                fclose(infile);
+            }
+            return 0;
+        }
+        char success = compress ?
+            huffman_compress_pipe(options, read_file, infile, write_file,
+                    outfile) :
+            huffman_decompress_pipe(options, read_file, infile, write_file,
+                    outfile);
+        if(!success) {
+            fprintf(stderr, compress ? "compression error\n" :
+                    "decompression error\n");
+        }
+        if(!stdin_input) {
+            fclose(infile);
+        }
+        if((stdout_output ? fflush(outfile) : fclose(outfile)) != 0) {
+            fprintf(stderr, "output file writting failure\n");
+            success = 0;
+        }
+        return success;
+    }
 
-    if(insize < 6) {
-        printf("wrong compressed data format\n");
+    size_t capacity, size = 0;
+    if(compress) {
+        capacity = huffman_compress_parallel_bound(input.size, options);
+    } else if(!huffman_decompress_parallel_size(input.data, input.size,
+                &capacity)) {
+        fprintf(stderr, "decompression error\n");
+        close_input(&input);
         return 0;
     }
 
-    uchar* input = (uchar*) malloc(insize);
-    if(fread(input, 1, insize, infile) != insize) {
-        printf("input file reading failure\n");
+    if(!map_output(outfile_name, capacity, &output)) {
+        fprintf(stderr, "output file opening failure\n");
+        close_input(&input);
         return 0;
     }
 
-    outsize = *((int*) input);
-
-    uchar* output = huffman_decompress(input);
+    char success = compress ?
+        huffman_compress_parallel_to(input.data, input.size, output.data,
+                capacity, &size, options) :
+        capacity == 0 || huffman_decompress_parallel_to(input.data,
+                input.size, output.data, capacity, &size, options);
+    if(!success) {
+        fprintf(stderr, compress ? "compression error\n" :
+                "decompression error\n");
+    }
 
-    if(!output) {
-        printf("decompression error\n");
-        return 0;
+    close_input(&input);
+    if(!close_output(&output, size)) {
+        fprintf(stderr, "output file writting failure\n");
+        success = 0;
     }
+    return success;
+}
 
-    free(input);
-    fclose(infile);
+char compress_file(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, char pipelined) {
+    return transcode_files(infile_name, outfile_name, options, 1, pipelined);
+}
 
-    FILE* outfile = fopen(outfile_name, "w");
+char decompress_file(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, char pipelined) {
+    return transcode_files(infile_name, outfile_name, options, 0, pipelined);
+}
 
-    if(fwrite(output, 1, outsize, outfile) != outsize) {
-        printf("output file writting failure\n");
+// decodes only the blocks of a seekable file which cover the range
+char decompress_range_file(const char* infile_name, const char* outfile_name,
+        const huffman_options* options, size_t offset, size_t size) {
+    mapped_file input;
+    int mapped = strcmp(infile_name, "-") == 0 ? 0 :
+        map_input(infile_name, &input);
+    if(mapped <= 0) {
+        fprintf(stderr, mapped < 0 ? "infile not found\n" :
+                "range needs a regular infile\n");
         return 0;
     }
+    posix_madvise(input.data, input.size, POSIX_MADV_RANDOM);
 
-    free(output);
-    fclose(outfile);
-    return 1;
+    // the range is cut at the end of the data
+    size_t total;
+    if(!huffman_seekable_size(input.data, input.size, &total)) {
+        fprintf(stderr, "infile isn't seekable\n");
+        close_input(&input);
+        return 0;
+    }
+    offset = offset < total ? offset : total;
+    size = size < total - offset ? size : total - offset;
 
-    return 0;
-}
+    uchar* data = (uchar*) malloc(size ? size : 1);
+    char success = huffman_decompress_range(input.data, input.size, offset,
+            size, data, options);
+    close_input(&input);
+    if(!success) {
+        fprintf(stderr, "decompression error\n");
+        free(data);
+        return 0;
+    }
 
+    char stdout_output = strcmp(outfile_name, "-") == 0;
+    FILE* outfile = stdout_output ? stdout : fopen(outfile_name, "wb");
+    if(!outfile) {
+        fprintf(stderr, "output file opening failure\n");
+        free(data);
+        return 0;
+    }
+    success = write_file(outfile, data, size);
+    if((stdout_output ? fflush(outfile) : fclose(outfile)) != 0 ||
+            !success) {
+        fprintf(stderr, "output file writting failure\n");
+        success = 0;
+    }
+    free(data);
+    return success;
+}
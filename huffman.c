@@ -1,15 +1,54 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
 #include "huffman.h"
-#include "heap.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+// kernels of hot loops are also built for BMI2 and AVX2 and picked by
+// cpuid, the rest is plain C99
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define KERNEL_DISPATCH
+#define KERNEL static inline __attribute__((always_inline))
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL static inline
+#endif
 #define uchar unsigned char
 #define MAX(x, y) (x) < (y) ? (y) : (x)
+#define MAX_CODE_LENGTH HUFFMAN_MAX_CODE_LENGTH
+#define STREAM_COUNT 4
+#define INTERLEAVED_MIN_SIZE 1024 // smaller blocks are coded as one stream
+#define PARALLEL_COUNT_MIN_SIZE (1 << 20)
+#define COUNT_CHUNK_SIZE (1 << 30) // keeps 32-bit partial counters exact
+#define MAX_LENGTHS_SIZE (3 + 256 * 4 / 8) // 4-bit lengths of all the bytes
+#define MAX_VARINT_SIZE 10 // 7 bits of a 64-bit number per byte
+#define MAX_CONTEXT_TABLES HUFFMAN_MAX_CONTEXT_TABLES
+#define CONTEXT_MIN_SIZE 4096 // smaller blocks don't pay for the tables
+#define CONTEXT_ROUNDS 8 // of moving the contexts to their cheapest tables
+// version, size and flags: a block which doesn't shrink is stored as is
+#define MAX_BLOCK_OVERHEAD (2 + MAX_VARINT_SIZE)
+
+// block format: version, varint data size, flags, code lengths, data
+#define FORMAT_VERSION 2
+
+// block flags, stored after the data size
+#define BLOCK_INTERLEAVED 1
+#define BLOCK_STORED 2 // data is copied as is
+#define BLOCK_RLE 4    // pairs of a byte and a varint run length minus one
+// table count, table of every previous byte, code lengths of the tables
+#define BLOCK_CONTEXT 8
+#define BLOCK_WIDE 16 // 16-bit symbols, with BLOCK_STORED or coded
+#define BLOCK_SHARED 32 // coded with the table of its batch
 
 typedef enum {false, true} bool;
 
 typedef struct encoder_tree_node_t {
-    int frequency;
+    uint64_t frequency;
     uchar is_leaf;
     union {
         struct {
@@ -21,398 +60,2572 @@ typedef struct encoder_tree_node_t {
 } encoder_tree_node;
 
 
-typedef struct decoder_tree_node_t {
-    uchar is_leaf;
-    union {
-        struct {
-            struct decoder_tree_node_t* zero; // left child
-            struct decoder_tree_node_t* one; // right child
-        } childs;
-        uchar symbol; // or symbol if it's not leaf
-    } data;
-} decoder_tree_node;
+// all the nodes of a tree of 256 leaves, leaves first
+typedef struct {
+    encoder_tree_node nodes[2 * 256 - 1];
+    int count;
+} encoder_tree;
+
+
+typedef struct {
+    uchar symbol;
+    uchar length;
+} decoder_entry;
+
+
+typedef struct {
+    decoder_entry entries[1 << MAX_CODE_LENGTH]; // by the next max_length bits
+    uchar max_length;
+    uchar min_length;
+} decoder_table;
 
 
 typedef struct {
-    uchar is_leaf;  
+    uint64_t code; // first bit of the code is the lowest one
+    uchar length;
     uchar symbol;
-} stored_tree_node;  // node of the tree that's stored in compressed data
+} canonical_code;
 
 
 typedef struct {
-    uchar* byte;
-    uchar bit_pos;
+    uchar* byte;     // where the next whole word goes
+    uint64_t bits;   // pending bits, the first one is the lowest
+    int bit_count;
 } bit_stream;
 
 
 typedef struct {
-    uchar* code;
+    uint64_t code; // first bit of the code is the lowest one
     uchar bit_length;
 } symbol_code;
 
 
 typedef struct {
     uchar symbol;
-    int frequency;
+    uint64_t frequency;
 } symbol_frequency;
 
 
-static encoder_tree_node*
-new_encoder_tree_leaf(int frequency, char symbol) {
-
-    encoder_tree_node* leaf = (encoder_tree_node*)
-        malloc(sizeof(encoder_tree_node));
-    leaf->frequency = frequency;
-    leaf->is_leaf = true;
-    leaf->data.symbol = symbol; 
-
-    return leaf;
+typedef struct {
+    symbol_code encoder[256]; // indexed dictionary of symbol codes
+    uchar lengths[256];
+    int sym_count;
+    int interleaved;
+    int stored;
+    int rle;     // runs are tried first and dropped if they are longer
+    int context; // order-1 codes
+    int table_count;
+    uchar context_map[256]; // table of every previous byte
+    uchar table_lengths[MAX_CONTEXT_TABLES][256];
+    symbol_code tables[MAX_CONTEXT_TABLES][256];
+    const symbol_code* shared; // code of the batch, no lengths are written
+    size_t size; // compressed size, exact for a single stream
+} block_encoder;
+
+
+// loops built for one instruction set, see select_kernels
+typedef struct {
+    const char* name;
+    void (*count_chunk)(const uchar* input, size_t size, uint64_t* counts);
+    size_t (*count_runs)(const uchar* input, size_t size);
+    size_t (*encode_data)(uchar* input, uchar* output, size_t insize,
+            size_t outsize, symbol_code* encoder);
+    int (*decode_data)(uchar* input, size_t insize, uchar* output,
+            size_t outsize, decoder_table* table);
+    int (*decode_data_interleaved)(uchar* input, size_t insize,
+            uchar* output, size_t outsize, decoder_table* table);
+} kernel_set;
+
+static kernel_set kernels; // defined with the generic set below
+
+
+static void write_le64(uchar* ptr, uint64_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(ptr, &value, 8);
+#else
+    for(int i = 0; i < 8; ++i) {
+        ptr[i] = (uchar) (value >> (8 * i));
+    }
+#endif
 }
 
 
-static encoder_tree_node*
-new_encoder_tree_nonleaf(int frequency, encoder_tree_node* zero,
-        encoder_tree_node* one) {
+static void write_le32(uchar* ptr, uint value) {
+    for(int i = 0; i < 4; ++i) {
+        ptr[i] = (uchar) (value >> (8 * i));
+    }
+}
 
-    encoder_tree_node* nonleaf = (encoder_tree_node*)
-        malloc(sizeof(encoder_tree_node));
-    nonleaf->frequency = frequency;
-    nonleaf->is_leaf = false;
-    nonleaf->data.childs.zero = zero;
-    nonleaf->data.childs.one = one;
 
-    return nonleaf;
+static uint64_t read_le64(const uchar* ptr) {
+    uint64_t value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&value, ptr, 8);
+#else
+    value = 0;
+    for(int i = 7; i >= 0; --i) {
+        value = (value << 8) | ptr[i];
+    }
+#endif
+    return value;
 }
 
 
-static int compare_node(const void* a, const void* b) {
-    // ascending order (such as we need for heap)
-    return ((encoder_tree_node*) a)->frequency -
-        ((encoder_tree_node*) b)->frequency;
+static uint read_le32(const uchar* ptr) {
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint) ptr[3] << 24);
 }
 
 
-static symbol_code append_bit(symbol_code code, char bit) {
-    symbol_code new_code;
-
-    new_code.code = (uchar*) malloc(16);
-    memcpy(new_code.code, code.code, 16);
-    new_code.bit_length = code.bit_length + 1;
+// 7 bits per byte starting from the lowest ones, the high bit is set
+// while more bytes follow
+static void write_varint(uchar** output, uint64_t value) {
+    while(value >= 0x80) {
+        *(*output)++ = (uchar) (value | 0x80);
+        value >>= 7;
+    }
+    *(*output)++ = (uchar) value;
+}
 
-    char offset = code.bit_length % 8;
-    char byte_pos = code.bit_length / 8;
 
-    if(bit) {
-        new_code.code[byte_pos] |= (1 << offset);
-    } else {
-        new_code.code[byte_pos] &= ~(1 << offset);
+// returns the number of bytes read or 0 if the number is broken
+static int read_varint(const uchar* input, size_t size, uint64_t* value) {
+    *value = 0;
+    for(int i = 0; i < MAX_VARINT_SIZE && (size_t) i < size; ++i) {
+        if(i == MAX_VARINT_SIZE - 1 && input[i] > 1) { // over 64 bits
+            return 0;
+        }
+        *value |= (uint64_t) (input[i] & 0x7f) << (7 * i);
+        if(!(input[i] & 0x80)) {
+            return i + 1;
+        }
     }
+    return 0;
+}
 
-    return new_code;
+
+// interleaved stream sizes of blocks over 4 GB take 64 bits
+static int jump_entry_size(uint64_t size) {
+    return size > UINT32_MAX ? 8 : 4;
 }
 
 
-static void copy_code(symbol_code* dest, symbol_code* src) {
-    memcpy(dest->code, src->code, 16);
-    dest->bit_length = src->bit_length;
+static int compare_frequency(uint64_t a, uint64_t b) {
+    return (a > b) - (a < b);
 }
 
 
 static int sf_compare_up(const void* a, const void* b) {
-    return ((symbol_frequency*) a)->frequency -
-        ((symbol_frequency*) b)->frequency;
+    return compare_frequency(((symbol_frequency*) a)->frequency,
+        ((symbol_frequency*) b)->frequency);
 }
 
 static int sf_compare_down(const void* a, const void* b) {
-    return ((symbol_frequency*) b)->frequency -
-        ((symbol_frequency*) a)->frequency;
+    return compare_frequency(((symbol_frequency*) b)->frequency,
+        ((symbol_frequency*) a)->frequency);
 }
 
 
-static symbol_frequency*
-calculate_frequencies(uchar* input, int size, int* outsize) {
-    uchar* ptr = input;
-    symbol_frequency* frequencies =
-        (symbol_frequency*) malloc(256 * sizeof(symbol_frequency));
+// counts bytes into 4 histograms in turn, so that runs of the same byte
+// don't wait for the previous increment of one counter
+KERNEL void count_chunk_body(const uchar* input, size_t size,
+        uint64_t* counts) {
+    uint partial[4][256];
+    memset(partial, 0, sizeof(partial));
+
+    const uchar* end = input + size;
+    for(; end - input >= 8; input += 8) {
+        uint64_t word = read_le64(input);
+        partial[0][word & 0xff]++;
+        partial[1][(word >> 8) & 0xff]++;
+        partial[2][(word >> 16) & 0xff]++;
+        partial[3][(word >> 24) & 0xff]++;
+        partial[0][(word >> 32) & 0xff]++;
+        partial[1][(word >> 40) & 0xff]++;
+        partial[2][(word >> 48) & 0xff]++;
+        partial[3][word >> 56]++;
+    }
+    while(input < end) {
+        partial[0][*input++]++;
+    }
 
-    *outsize = 0;
     for(int i = 0; i < 256; ++i) {
-        frequencies[i].frequency = 0;
-        frequencies[i].symbol = (uchar) i;
+        counts[i] += (uint64_t) partial[0][i] + partial[1][i] +
+            partial[2][i] + partial[3][i];
     }
+}
 
-    for(int i = 0; i < size; ++i) {
-        if(frequencies[*ptr].frequency == 0) {
-            (*outsize)++;
-        }
-        frequencies[*ptr++].frequency++;
+
+static void count_chunk(const uchar* input, size_t size, uint64_t* counts) {
+    kernels.count_chunk(input, size, counts);
+}
+
+
+static void count_symbols(const uchar* input, size_t size, uint64_t* counts) {
+    memset(counts, 0, 256 * sizeof(uint64_t));
+    for(size_t offset = 0; offset < size; offset += COUNT_CHUNK_SIZE) {
+        count_chunk(input + offset, size - offset < COUNT_CHUNK_SIZE ?
+                size - offset : COUNT_CHUNK_SIZE, counts);
+    }
+}
+
+
+typedef struct {
+    const uchar* input;
+    size_t size;
+    size_t chunk;
+    uint64_t (*counts)[256];
+} count_context;
+
+
+static void count_job(void* context, int index) {
+    count_context* job = (count_context*) context;
+    size_t offset = index * job->chunk;
+    size_t size = job->size - offset < job->chunk ?
+        job->size - offset : job->chunk;
+    count_symbols(job->input + offset, size, job->counts[index]);
+}
+
+
+// pool of the threads which count the bytes of a large input, NULL when
+// it's counted alone: workers of stream blocks pass a single thread, as
+// the blocks are already parallel
+static worker_pool* count_pool(size_t size, const huffman_options* options) {
+    return size >= PARALLEL_COUNT_MIN_SIZE ? pool_create(options->threads) :
+        NULL;
+}
+
+
+// large inputs are counted by parts on the threads of the pool
+static void count_symbols_parallel(const uchar* input, size_t size,
+        uint64_t* counts, worker_pool* pool, int threads) {
+    if(!pool || threads <= 1 || size < PARALLEL_COUNT_MIN_SIZE) {
+        count_symbols(input, size, counts);
+        return;
+    }
+
+    count_context job = { input, size, (size - 1) / threads + 1, NULL };
+    job.counts = (uint64_t (*)[256]) malloc(threads * sizeof(*job.counts));
+    if(!job.counts) { // the calling thread still can count alone
+        count_symbols(input, size, counts);
+        return;
     }
+    pool_run(pool, count_job, &job, threads);
 
-    // sort by freq down
-    qsort(frequencies, 256, sizeof(symbol_frequency), sf_compare_down);
-    frequencies = realloc(frequencies, (*outsize) * sizeof(symbol_frequency));
-    return frequencies;
+    memset(counts, 0, 256 * sizeof(uint64_t));
+    for(int i = 0; i < threads; ++i) {
+        for(int k = 0; k < 256; ++k) {
+            counts[k] += job.counts[i][k];
+        }
+    }
+    free(job.counts);
 }
 
 
-static encoder_tree_node* 
-generate_encoder_tree(symbol_frequency* frequencies, int size) {
-    if(size == 1) { // special case where there's only one symbol
-        return new_encoder_tree_leaf(frequencies[0].frequency,
-                frequencies[0].symbol);
+// symbols which appear in the data sorted by frequency down,
+// returns their count
+static int sort_frequencies(uint64_t* counts, symbol_frequency* frequencies) {
+    int count = 0;
+    for(int i = 0; i < 256; ++i) {
+        if(counts[i]) {
+            frequencies[count].frequency = counts[i];
+            frequencies[count].symbol = (uchar) i;
+            count++;
+        }
     }
 
-    binary_heap* heap = heap_create(size, compare_node);
-    symbol_frequency* ptr = frequencies;
+    qsort(frequencies, count, sizeof(symbol_frequency), sf_compare_down);
+    return count;
+}
+
 
-    // for every symbol make node and push into heap
+// two queues: the leaves in ascending order of frequency and the inner
+// nodes, which are created in ascending order too, so the two smallest
+// nodes are always at the fronts; frequencies must be sorted down
+static encoder_tree_node*
+generate_encoder_tree(symbol_frequency* frequencies, int size,
+        encoder_tree* tree) {
+    encoder_tree_node* nodes = tree->nodes;
     for(int i = 0; i < size; ++i) {
-        encoder_tree_node* node =
-            new_encoder_tree_leaf(ptr->frequency, ptr->symbol);
-        heap_insert(heap, node);
-        ptr++;
+        nodes[i].frequency = frequencies[size - 1 - i].frequency;
+        nodes[i].is_leaf = true;
+        nodes[i].data.symbol = frequencies[size - 1 - i].symbol;
+    }
+    tree->count = size;
+
+    int leaf = 0, inner = size; // fronts of the queues
+    while(tree->count < 2 * size - 1) {
+        encoder_tree_node* pair[2];
+        for(int k = 0; k < 2; ++k) {
+            pair[k] = leaf < size && (inner == tree->count ||
+                    nodes[leaf].frequency <= nodes[inner].frequency) ?
+                nodes + leaf++ : nodes + inner++;
+        }
+        encoder_tree_node* parent = nodes + tree->count++;
+        parent->frequency = pair[0]->frequency + pair[1]->frequency;
+        parent->is_leaf = false;
+        parent->data.childs.zero = pair[0];
+        parent->data.childs.one = pair[1];
+    }
+    return nodes + tree->count - 1;
+}
+
+
+// optimal code lengths not exceeding max_length of count frequencies
+// sorted in descending order, stored by their rank (package-merge);
+// weights take 4 * count entries and items max_length * 2 * count
+static void merge_rank_lengths(const uint64_t* frequencies, int count,
+        int max_length, uchar* lengths, uint64_t* weights, int* items) {
+    int capacity = 2 * count;
+    uint64_t* previous = weights, *current = weights + capacity;
+    // every list item is a rank or -1 for a package of two items
+    // of the previous list
+    int previous_size = 0;
+
+    for(int level = 0; level < max_length; ++level) {
+        int* level_items = items + level * capacity;
+        int packages = previous_size / 2, leaf = count - 1, package = 0;
+        int size = 0;
+        while(leaf >= 0 || package < packages) {
+            uint64_t package_weight = package < packages ?
+                previous[2 * package] + previous[2 * package + 1] :
+                UINT64_MAX;
+            if(leaf >= 0 && frequencies[leaf] <= package_weight) {
+                current[size] = frequencies[leaf];
+                level_items[size++] = leaf--;
+            } else {
+                current[size] = package_weight;
+                level_items[size++] = -1;
+                package++;
+            }
+        }
+        uint64_t* tmp = previous;
+        previous = current;
+        current = tmp;
+        previous_size = size;
     }
-    // get 2 nodes from heap and create its parent node 
-    // until there's only one element
-    while(heap->size > 1) {
-        encoder_tree_node* node0 = heap_pop(heap);
-        encoder_tree_node* node1 = heap_pop(heap);
-        encoder_tree_node* node_parent = new_encoder_tree_nonleaf(
-                node1->frequency + node0->frequency, node0, node1);
 
-        heap_insert(heap, node_parent);
+    // every time a symbol is selected its code becomes one bit longer
+    memset(lengths, 0, count);
+    int selected = 2 * count - 2;
+    for(int level = max_length - 1; level >= 0; --level) {
+        int* level_items = items + level * capacity;
+        int packages = 0;
+        for(int i = 0; i < selected; ++i) {
+            if(level_items[i] < 0) {
+                packages++;
+            } else {
+                lengths[level_items[i]]++;
+            }
+        }
+        selected = 2 * packages;
     }
-    encoder_tree_node* root = heap_pop(heap);
-    heap_destroy(heap, NULL);
-    return root;
 }
 
 
-static void destroy_encoder_tree(encoder_tree_node* root) {
-    if(!root) {
-        return;
-    } else if(!root->is_leaf) {
-        destroy_encoder_tree(root->data.childs.zero);
-        destroy_encoder_tree(root->data.childs.one);
+// same with the lists on the heap, returns 0 if the memory ran out
+static int limit_rank_lengths(const uint64_t* frequencies, int count,
+        int max_length, uchar* lengths) {
+    uint64_t* weights = (uint64_t*) malloc(4 * count * sizeof(uint64_t));
+    int* items = (int*) malloc(max_length * 2 * count * sizeof(int));
+    if(weights && items) {
+        merge_rank_lengths(frequencies, count, max_length, lengths, weights,
+                items);
     }
-    free(root);
+    free(weights);
+    free(items);
+    return weights && items;
 }
 
 
-static symbol_code* build_encoder() {
-    symbol_code* encoder = (symbol_code*) malloc(256 * sizeof(symbol_code));
-    for(int i = 0; i < 256; ++i) {
-        encoder[i].code = (uchar*) calloc(16, 1);
-        encoder[i].bit_length = 0;
+// frequencies must be sorted in descending order
+static void limit_code_lengths(symbol_frequency* freqs, int count,
+        int max_length, uchar* lengths) {
+    uint64_t frequencies[256] = { 0 };
+    uchar rank_lengths[256];
+    // lists of at most 256 symbols fit on the stack, so a block is coded
+    // without allocations
+    uint64_t weights[4 * 256];
+    int items[MAX_CODE_LENGTH * 2 * 256];
+    for(int i = 0; i < count; ++i) {
+        frequencies[i] = freqs[i].frequency;
+    }
+    merge_rank_lengths(frequencies, count, max_length, rank_lengths, weights,
+            items);
+    memset(lengths, 0, 256);
+    for(int i = 0; i < count; ++i) {
+        lengths[freqs[i].symbol] = rank_lengths[i];
     }
+}
+
 
-    return encoder;
+static void write_code(bit_stream* stream, symbol_code* code) {
+    stream->bits |= code->code << stream->bit_count;
+    stream->bit_count += code->bit_length;
+    if(stream->bit_count >= 64) { // flush the whole word
+        write_le64(stream->byte, stream->bits);
+        stream->byte += 8;
+        stream->bit_count -= 64;
+        // bits of the code which didn't fit into the flushed word
+        stream->bits = stream->bit_count ?
+            code->code >> (code->bit_length - stream->bit_count) : 0;
+    }
 }
 
 
-static void destroy_encoder(symbol_code* encoder) {
-    for(int i = 0; i < 256; ++i) {
-        free(encoder[i].code);
+static void flush_stream(bit_stream* stream) {
+    for(; stream->bit_count > 0; stream->bit_count -= 8) {
+        *stream->byte++ = (uchar) stream->bits;
+        stream->bits >>= 8;
     }
-    free(encoder);
+    stream->bit_count = 0;
 }
 
 
-static void fill_encoder(encoder_tree_node* root, symbol_code* encoder,
-        symbol_code prefix) {
+static void
+tree_code_lengths(encoder_tree_node* root, uchar* lengths, int depth) {
     if(root->is_leaf) {
-        copy_code(encoder + root->data.symbol, &prefix);
+        lengths[root->data.symbol] = depth ? depth : 1;
     } else {
-        fill_encoder(root->data.childs.zero, encoder, append_bit(prefix, 0));
-        fill_encoder(root->data.childs.one, encoder, append_bit(prefix, 1));
+        tree_code_lengths(root->data.childs.zero, lengths, depth + 1);
+        tree_code_lengths(root->data.childs.one, lengths, depth + 1);
     }
-    free(prefix.code);
 }
 
 
-static void write_tree(encoder_tree_node* root, uchar** output, int* size){
-    stored_tree_node node;
-    node.is_leaf = root->is_leaf;
-    node.symbol = root->data.symbol;
+static uint64_t reverse_bits(uint64_t code, int length) {
+    uint64_t reversed = 0;
+    for(int i = 0; i < length; ++i, code >>= 1) {
+        reversed = (reversed << 1) | (code & 1);
+    }
+    return reversed;
+}
+
 
-    memcpy(*output, &node, sizeof(node));
-    (*output) += sizeof(node);
-    (*size) += sizeof(node);
+// canonical codes ordered by (length, symbol); codes with a common
+// prefix are adjacent in this order
+static int canonical_codes(uchar* lengths, canonical_code* codes) {
+    int count = 0;
+    for(int length = 1; length <= MAX_CODE_LENGTH; ++length) {
+        for(int symbol = 0; symbol < 256; ++symbol) {
+            if(lengths[symbol] == length) {
+                codes[count].symbol = symbol;
+                codes[count].length = length;
+                count++;
+            }
+        }
+    }
 
-    if(!root->is_leaf) {
-        write_tree(root->data.childs.zero, output, size);
-        write_tree(root->data.childs.one, output, size);
+    uint64_t code = 0;
+    for(int i = 0; i < count; ++i) {
+        if(i > 0) {
+            code = (code + 1) << (codes[i].length - codes[i - 1].length);
+        }
+        // the code is written starting from its most significant bit
+        codes[i].code = reverse_bits(code, codes[i].length);
     }
+    return count;
 }
 
 
-static decoder_tree_node* read_decoder_tree(uchar** input, int* leaf_count) {
-    stored_tree_node node;
-    memcpy(&node, *input, sizeof(node));
-    (*input) += sizeof(node);
+static void fill_encoder(uchar* lengths, symbol_code* encoder) {
+    canonical_code codes[256];
+    int count = canonical_codes(lengths, codes);
+    for(int i = 0; i < count; ++i) {
+        encoder[codes[i].symbol].code = codes[i].code;
+        encoder[codes[i].symbol].bit_length = codes[i].length;
+    }
+}
 
-    decoder_tree_node* root =
-        (decoder_tree_node*) malloc(sizeof(decoder_tree_node));
 
-    if((root->is_leaf = node.is_leaf)) {
-        root->data.symbol = node.symbol;
-        if(leaf_count) {
-            (*leaf_count)++;
+// code lengths header: first and last symbol with a code, then (if there
+// are more symbols) the bit width of a length and the lengths of all
+// the symbols in between packed with this width
+static void lengths_range(uchar* lengths, int* first, int* last, int* width) {
+    int max_length = 0;
+    *first = 255;
+    *last = 0;
+    for(int i = 0; i < 256; ++i) {
+        if(lengths[i]) {
+            *first = *first < i ? *first : i;
+            *last = i;
+            max_length = MAX(max_length, lengths[i]);
         }
-    } else {
-        root->data.childs.zero = read_decoder_tree(input, leaf_count);
-        root->data.childs.one = read_decoder_tree(input, leaf_count);
     }
-    return root;
+    for(*width = 1; (1 << *width) <= max_length; ++(*width));
 }
 
 
-static void destroy_decoder_tree(decoder_tree_node* root) {
-    if(!root->is_leaf) {
-        destroy_decoder_tree(root->data.childs.zero);
-        destroy_decoder_tree(root->data.childs.one);
+static int lengths_size(uchar* lengths) {
+    int first, last, width;
+    lengths_range(lengths, &first, &last, &width);
+    if(first == last) {
+        return 2;
     }
-    free(root);
+    return 3 + ((last - first + 1) * width + 7) / 8;
 }
 
 
-static void write_code(bit_stream* stream, symbol_code* code) {
-    int bits_left = code->bit_length, offset = 0;
-    uchar* code_ptr = code->code;
-    while(bits_left) {
-        short code_bytes = (*((short*) code_ptr) << stream->bit_pos) >> offset;
-        *((short*) stream->byte) |= code_bytes; // write 2 bytes of code
-
-        if(bits_left < 16 - stream->bit_pos) { // if rest of code was written
-            stream->byte += ((stream->bit_pos + bits_left) > 7);
-            stream->bit_pos = (stream->bit_pos + bits_left) % 8;
-            bits_left = 0;
-        } else {
-            // how much bits were written
-            // to the first byte of stream
-            offset = (8 - stream->bit_pos) * (stream->bit_pos != 0);
-            // move 1 or 2 bytes forward
-            code_ptr += 1 + (stream->bit_pos == 0); 
-            stream->byte += 2;
-            bits_left -= (16 - stream->bit_pos);
-            stream->bit_pos = 0;
+static void write_lengths(uchar* lengths, uchar** output) {
+    int first, last, width;
+    lengths_range(lengths, &first, &last, &width);
+    *(*output)++ = first;
+    *(*output)++ = last;
+    if(first == last) {
+        return;
+    }
+    *(*output)++ = width;
+
+    bit_stream stream = { *output, 0, 0 };
+    for(int i = first; i <= last; ++i) {
+        symbol_code length = { lengths[i], width };
+        write_code(&stream, &length);
+    }
+    flush_stream(&stream);
+    *output = stream.byte;
+}
+
+
+// returns the number of symbols with a code or -1 if lengths are broken
+static int read_lengths(uchar** input, uchar* lengths) {
+    uchar* ptr = *input;
+    int first = *ptr++, last = *ptr++;
+    memset(lengths, 0, 256);
+
+    if(first > last) {
+        return -1;
+    } else if(first == last) { // single symbol, no codes needed
+        lengths[first] = 1;
+        *input = ptr;
+        return 1;
+    }
+
+    int width = *ptr++;
+    if(width < 1 || width > 4) {
+        return -1;
+    }
+    int count = 0;
+    uint64_t kraft = 0; // complete prefix code has a sum of 2^-length == 1
+    for(int i = first, bit = 0; i <= last; ++i) {
+        int length = 0;
+        for(int k = 0; k < width; ++k, ++bit) {
+            length |= ((ptr[bit / 8] >> (bit % 8)) & 1) << k;
+        }
+        if(length > MAX_CODE_LENGTH) {
+            return -1;
+        }
+        if(length) {
+            kraft += (uint64_t) 1 << (MAX_CODE_LENGTH - length);
+            count++;
+        }
+        lengths[i] = length;
+    }
+    if(kraft != (uint64_t) 1 << MAX_CODE_LENGTH) {
+        return -1;
+    }
+    *input = ptr + ((last - first + 1) * width + 7) / 8;
+    return count;
+}
+
+
+static void build_decoder_table(uchar* lengths, decoder_table* table) {
+    canonical_code codes[256];
+    int count = canonical_codes(lengths, codes);
+
+    // codes are ordered by length
+    table->min_length = codes[0].length;
+    table->max_length = codes[count - 1].length;
+
+    // every code fills all the entries which start with it
+    uint size = 1u << table->max_length;
+    for(int i = 0; i < count; ++i) {
+        decoder_entry entry = { codes[i].symbol, codes[i].length };
+        for(uint k = codes[i].code; k < size; k += 1u << codes[i].length) {
+            table->entries[k] = entry;
         }
     }
 }
 
 
-static int
-encode_data(uchar* input, uchar* output, int insize, symbol_code* encoder) {
-    bit_stream* stream = (bit_stream*) malloc(sizeof(bit_stream));
-    stream->byte = output;
-    stream->bit_pos = 0;
+KERNEL size_t encode_data_body(uchar* input, uchar* output, size_t insize,
+        size_t outsize, symbol_code* encoder) {
+    uchar* input_end = input + insize;
+    uchar* output_end = output + outsize;
+    int max_length = 1;
+    for(int i = 0; i < 256; ++i) {
+        max_length = MAX(max_length, encoder[i].bit_length);
+    }
 
-    for(int i = 0; i < insize; ++i, ++input) {
-        write_code(stream, encoder + (*input));
+    bit_stream stream;
+    stream.byte = output;
+    stream.bits = 0;
+    stream.bit_count = 0;
+
+    // as many codes as surely fit into 56 bits are accumulated,
+    // then the whole word is stored and the pointer is moved by the
+    // complete bytes only (the rest is rewritten by the next store)
+    int per_word = 56 / max_length;
+    while(input_end - input >= per_word && output_end - stream.byte >= 8) {
+        for(int i = 0; i < per_word; ++i) {
+            symbol_code* code = encoder + *input++;
+            stream.bits |= code->code << stream.bit_count;
+            stream.bit_count += code->bit_length;
+        }
+        write_le64(stream.byte, stream.bits);
+        stream.byte += stream.bit_count >> 3;
+        stream.bits >>= stream.bit_count & ~7;
+        stream.bit_count &= 7;
     }
 
-    int outsize = stream->byte - output + (stream->bit_pos > 0);
+    for(; input < input_end; ++input) {
+        write_code(&stream, encoder + (*input));
+    }
+    flush_stream(&stream);
 
-    free(stream);
-    return outsize;
+    return stream.byte - output;
 }
 
 
-uchar* huffman_compress(uchar* input, int insize, int* outsize) {
-    if(!input) {
-        return NULL;
+static size_t encode_data(uchar* input, uchar* output, size_t insize,
+        size_t outsize, symbol_code* encoder) {
+    return kernels.encode_data(input, output, insize, outsize, encoder);
+}
+
+
+// every byte is coded with the table of the byte before it
+static size_t encode_context_data(uchar* input, uchar* output, size_t insize,
+        size_t outsize, block_encoder* block) {
+    uchar* input_end = input + insize;
+    uchar* output_end = output + outsize;
+    symbol_code* encoders[256]; // by the previous byte
+    int max_length = 1;
+    for(int i = 0; i < 256; ++i) {
+        encoders[i] = block->tables[block->context_map[i]];
     }
-    if(!outsize) {
-        return NULL;
+    for(int j = 0; j < block->table_count; ++j) {
+        for(int i = 0; i < 256; ++i) {
+            max_length = MAX(max_length, block->tables[j][i].bit_length);
+        }
     }
-    if(insize <= 0) {
-        return NULL;
+
+    bit_stream stream = { output, 0, 0 };
+    uchar previous = 0;
+    int per_word = 56 / max_length; // same as in encode_data
+    while(input_end - input >= per_word && output_end - stream.byte >= 8) {
+        for(int i = 0; i < per_word; ++i) {
+            symbol_code* code = encoders[previous] + *input;
+            previous = *input++;
+            stream.bits |= code->code << stream.bit_count;
+            stream.bit_count += code->bit_length;
+        }
+        write_le64(stream.byte, stream.bits);
+        stream.byte += stream.bit_count >> 3;
+        stream.bits >>= stream.bit_count & ~7;
+        stream.bit_count &= 7;
+    }
+
+    for(; input < input_end; previous = *input++) {
+        write_code(&stream, encoders[previous] + *input);
+    }
+    flush_stream(&stream);
+
+    return stream.byte - output;
+}
+
+
+// number of runs of equal bytes, 8 neighbour pairs are compared at once
+static size_t count_runs_generic(const uchar* input, size_t size) {
+    size_t runs = 1, i = 1;
+    for(; i + 8 <= size; i += 8) {
+        // the lowest bit of every byte is set where the byte differs
+        uint64_t diff = read_le64(input + i) ^ read_le64(input + i - 1);
+        diff |= diff >> 4;
+        diff |= diff >> 2;
+        diff |= diff >> 1;
+        runs += ((diff & 0x0101010101010101ull) *
+                0x0101010101010101ull) >> 56;
     }
+    for(; i < size; ++i) {
+        runs += input[i] != input[i - 1];
+    }
+    return runs;
+}
+
+
+static size_t count_runs(const uchar* input, size_t size) {
+    return kernels.count_runs(input, size);
+}
+
 
-    uchar* output = (uchar*) calloc(insize + 1024, 1);
+// returns the size of the runs or 0 if they don't fit into outsize bytes
+static size_t encode_runs(const uchar* input, size_t insize, uchar* output,
+        size_t outsize) {
     uchar* ptr = output;
-    int sym_count;
-    *outsize = 0;
+    size_t i = 0;
+    while(i < insize) {
+        uint64_t pattern = input[i] * 0x0101010101010101ull;
+        size_t run = 1;
+        while(i + run + 8 <= insize && read_le64(input + i + run) == pattern) {
+            run += 8;
+        }
+        while(i + run < insize && input[i + run] == input[i]) {
+            run++;
+        }
+        if(outsize - (ptr - output) < 1 + MAX_VARINT_SIZE) {
+            return 0; // the longest pair might not fit
+        }
+        *ptr++ = input[i];
+        write_varint(&ptr, run - 1);
+        i += run;
+    }
+    return ptr - output;
+}
 
-    // calculate symbol frequencies
-    symbol_frequency* freqs = calculate_frequencies(input, insize, &sym_count);
-    // encoder tree
-    encoder_tree_node* tree = generate_encoder_tree(freqs, sym_count);
-    free(freqs);
 
-    memcpy(ptr, &insize, 4); // store input data size 
-    ptr += 4;
-    *outsize += 4;
+void huffman_default_options(huffman_options* options) {
+    options->max_code_length = HUFFMAN_DEFAULT_CODE_LENGTH;
+    options->block_size = HUFFMAN_DEFAULT_BLOCK_SIZE;
+    options->threads = 1;
+    options->interleaved = 0;
+    options->seekable = 0;
+    options->context_tables = 0;
+    options->batch_table = 0;
+}
+
 
-    write_tree(tree, &ptr, outsize); // store tree and add its size to outsize
+static int valid_block_options(const huffman_options* options) {
+    return options->max_code_length >= HUFFMAN_MIN_CODE_LENGTH &&
+        options->max_code_length <= MAX_CODE_LENGTH &&
+        options->context_tables >= 0 &&
+        options->context_tables <= MAX_CONTEXT_TABLES;
+}
 
-    if(sym_count > 1) { // if it's == 0 -> do nothing
-        // bit prefix for recursive tree traverse 
-        symbol_code prefix;
-        prefix.bit_length = 0;
-        prefix.code = (uchar*) calloc(16, 1);
 
-        // encoder is the indexed dictionary of symbol codes
-        symbol_code* encoder = build_encoder();
-        fill_encoder(tree, encoder, prefix);
+// optimal code lengths of the symbols limited to max_length
+static void code_lengths(symbol_frequency* freqs, int count, int max_length,
+        uchar* lengths) {
+    encoder_tree tree;
+    memset(lengths, 0, 256);
+    tree_code_lengths(generate_encoder_tree(freqs, count, &tree), lengths, 0);
 
-        *outsize += encode_data(input, ptr, insize, encoder); // encode data
-        destroy_encoder(encoder);
+    for(int i = 0; i < 256; ++i) {
+        if(lengths[i] > max_length) { // tree is too deep
+            limit_code_lengths(freqs, count, max_length, lengths);
+            break;
+        }
     }
-    destroy_encoder_tree(tree);
-    output = realloc(output, *outsize);
-    return output;
 }
 
-static void
-decode_data(uchar* input, uchar* output, int outsize, decoder_tree_node* dtree){
-    decoder_tree_node* root = dtree; // we will go down the tree until a leaf
-    uchar bit_mask = 1;
-    int data_read = 0;
-
-    while(data_read != outsize) {
-        if(root->is_leaf) { // if leaf is reached
-            *(output) = root->data.symbol; // write symbol
-            ++output;
-            data_read++;
-            root = dtree;
-        } else {
-            if(bit_mask & (*input)) {
-                root = root->data.childs.one; // right child
-            } else {
-                root = root->data.childs.zero; // left child
+
+// bits of an entry of the context map
+static int context_map_width(int table_count) {
+    int width = 1;
+    while((1 << width) < table_count) {
+        width++;
+    }
+    return width;
+}
+
+
+static size_t context_header_size(block_encoder* block) {
+    size_t size = 1 + (256 * context_map_width(block->table_count) + 7) / 8;
+    for(int i = 0; i < block->table_count; ++i) {
+        size += lengths_size(block->table_lengths[i]);
+    }
+    return size;
+}
+
+
+// bits of every byte in every table, smoothed so that the bytes which
+// a table hasn't seen yet are possible but expensive
+static void context_costs(uint64_t (*tables)[256], int count,
+        double (*costs)[256]) {
+    for(int j = 0; j < count; ++j) {
+        uint64_t total = 0;
+        for(int s = 0; s < 256; ++s) {
+            total += tables[j][s];
+        }
+        for(int s = 0; s < 256; ++s) {
+            costs[j][s] = log2((total + 128.0) / (tables[j][s] + 0.5));
+        }
+    }
+}
+
+
+// order-1 model: previous bytes followed by similar bytes share a code,
+// so that at most context_tables codes are built; the contexts are
+// clustered by a few rounds of k-means seeded with the most frequent ones
+// and moved to the table where their next bytes take the fewest bits;
+// returns the size of the coded data in bits or 0 if the contexts don't
+// split into several tables
+static uint64_t prepare_context(uchar* input, size_t insize,
+        const huffman_options* options, block_encoder* block) {
+    uint* counts = (uint*) calloc(256 * 256, sizeof(uint));
+    if(!counts) {
+        return 0;
+    }
+    counts[input[0]]++; // the first byte follows a zero one
+    for(size_t i = 1; i < insize; ++i) {
+        counts[(input[i - 1] << 8) | input[i]]++;
+    }
+
+    // contexts which occur sorted by frequency down
+    uint64_t totals[256];
+    int order[256], used = 0;
+    for(int c = 0; c < 256; ++c) {
+        totals[c] = 0;
+        for(int s = 0; s < 256; ++s) {
+            totals[c] += counts[(c << 8) | s];
+        }
+        if(!totals[c]) {
+            continue;
+        }
+        int i = used++;
+        for(; i > 0 && totals[order[i - 1]] < totals[c]; --i) {
+            order[i] = order[i - 1];
+        }
+        order[i] = c;
+    }
+
+    int table_count = used < options->context_tables ?
+        used : options->context_tables;
+    uint64_t tables[MAX_CONTEXT_TABLES][256];
+    double costs[MAX_CONTEXT_TABLES][256];
+    memset(block->context_map, 0, sizeof(block->context_map));
+    memset(tables, 0, sizeof(tables));
+    for(int j = 0; j < table_count; ++j) {
+        for(int s = 0; s < 256; ++s) {
+            tables[j][s] = counts[(order[j] << 8) | s];
+        }
+    }
+
+    for(int round = 0; round < CONTEXT_ROUNDS && table_count > 1; ++round) {
+        context_costs(tables, table_count, costs);
+        int moved = 0;
+        for(int i = 0; i < used; ++i) {
+            uint* row = counts + (order[i] << 8);
+            double bits[MAX_CONTEXT_TABLES] = { 0 };
+            for(int s = 0; s < 256; ++s) {
+                if(row[s]) {
+                    for(int j = 0; j < table_count; ++j) {
+                        bits[j] += row[s] * costs[j][s];
+                    }
+                }
+            }
+            int best = 0;
+            for(int j = 1; j < table_count; ++j) {
+                best = bits[j] < bits[best] ? j : best;
             }
+            moved += best != block->context_map[order[i]];
+            block->context_map[order[i]] = best;
+        }
+        if(round > 0 && !moved) {
+            break;
+        }
 
-            if(!(bit_mask <<= 1)) { // bit shift in loop
-                ++input;
-                bit_mask = 1;
+        // tables of the moved contexts, the empty ones are dropped
+        uint64_t sizes[MAX_CONTEXT_TABLES] = { 0 };
+        memset(tables, 0, sizeof(tables));
+        for(int i = 0; i < used; ++i) {
+            int j = block->context_map[order[i]];
+            sizes[j] += totals[order[i]];
+            for(int s = 0; s < 256; ++s) {
+                tables[j][s] += counts[(order[i] << 8) | s];
             }
         }
+        int kept[MAX_CONTEXT_TABLES], count = 0;
+        for(int j = 0; j < table_count; ++j) {
+            kept[j] = count;
+            if(sizes[j]) {
+                memmove(tables[count++], tables[j], sizeof(tables[j]));
+            }
+        }
+        for(int c = 0; c < 256; ++c) {
+            block->context_map[c] = kept[block->context_map[c]];
+        }
+        table_count = count;
+    }
+    free(counts);
+    if(table_count < 2) {
+        return 0;
+    }
+
+    uint64_t data_bits = 0;
+    block->table_count = table_count;
+    memset(block->tables, 0, sizeof(block->tables));
+    for(int j = 0; j < table_count; ++j) {
+        symbol_frequency freqs[256];
+        int count = sort_frequencies(tables[j], freqs);
+        code_lengths(freqs, count, options->max_code_length,
+                block->table_lengths[j]);
+        fill_encoder(block->table_lengths[j], block->tables[j]);
+        for(int i = 0; i < count; ++i) {
+            data_bits += freqs[i].frequency *
+                block->tables[j][freqs[i].symbol].bit_length;
+        }
     }
+    return data_bits;
 }
 
-uchar* huffman_decompress(uchar* input) {
-    if(input == NULL) {
-        return NULL;
+
+static uint64_t clock_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+
+// adds the time since start to the stage and starts the next one
+static void lap(uint64_t* stage, uint64_t* start) {
+    uint64_t now = clock_ns();
+    *stage += now - *start;
+    *start = now;
+}
+
+
+// builds the code for the data and finds the size of the compressed block,
+// the pool and stats are optional
+static void prepare_block(uchar* input, size_t insize,
+        const huffman_options* options, worker_pool* pool,
+        block_encoder* block, huffman_stats* stats) {
+    symbol_frequency freqs[256];
+    uint64_t counts[256];
+    uint64_t time = stats ? clock_ns() : 0;
+
+    // calculate symbol frequencies
+    count_symbols_parallel(input, insize, counts, pool, options->threads);
+    if(stats) {
+        memcpy(stats->histogram, counts, sizeof(counts));
+        lap(&stats->histogram_ns, &time);
+    }
+    block->sym_count = sort_frequencies(counts, freqs);
+    code_lengths(freqs, block->sym_count, options->max_code_length,
+            block->lengths);
+    if(stats) {
+        lap(&stats->tree_ns, &time);
     }
 
-    uchar* ptr = input;
-    int outsize = ((int*) ptr)[0]; // extract size of decompressed data
-    if(outsize <= 0) {
-        return NULL;
+    // encoder is the indexed dictionary of symbol codes
+    memset(block->encoder, 0, sizeof(block->encoder));
+    uint64_t data_bits = 0;
+    if(block->sym_count > 1) { // for a single symbol the lengths are enough
+        fill_encoder(block->lengths, block->encoder);
+        for(int i = 0; i < block->sym_count; ++i) {
+            data_bits += freqs[i].frequency *
+                block->encoder[freqs[i].symbol].bit_length;
+        }
+    }
+    if(stats) {
+        lap(&stats->encoder_ns, &time);
     }
-    ptr += 4;
 
-    uchar* output = (uchar*) malloc(outsize);
-    int leaf_count = 0;
-    decoder_tree_node* dtree = read_decoder_tree(&ptr, &leaf_count); // decoder
+    block->interleaved = options->interleaved && block->sym_count > 1 &&
+        insize >= INTERLEAVED_MIN_SIZE;
+
+    // version, size, flags, code lengths and the encoded data; every
+    // interleaved stream can take one more partial byte
+    uchar varint[MAX_VARINT_SIZE], *end = varint;
+    write_varint(&end, insize);
+    size_t header = 2 + (end - varint);
+    block->size = header + lengths_size(block->lengths) +
+        (size_t) ((data_bits + 7) / 8) + (block->interleaved ?
+                (STREAM_COUNT - 1) * jump_entry_size(insize) +
+                STREAM_COUNT - 1 : 0);
+
+    block->shared = NULL;
+    block->context = 0;
+    if(options->context_tables > 1 && block->sym_count > 1 &&
+            insize >= CONTEXT_MIN_SIZE && insize <= UINT32_MAX) {
+        uint64_t bits = prepare_context(input, insize, options, block);
+        size_t size = bits ? header + context_header_size(block) +
+            (size_t) ((bits + 7) / 8) : 0;
+        if(bits && size < block->size) {
+            block->context = 1;
+            block->interleaved = 0;
+            block->size = size;
+        }
+        if(stats) {
+            lap(&stats->tree_ns, &time);
+        }
+    }
 
-    if(leaf_count > 1) {
-        decode_data(ptr, output, outsize, dtree);
-    } else { // special case when there's only one symbol appears in data
-        memset(output, dtree->data.symbol, outsize);
+    // the cheapest mode wins: the data as is when the code doesn't shrink
+    // it, then the runs if each of them in two bytes is shorter still
+    block->stored = block->size >= header + insize;
+    if(block->stored) {
+        block->interleaved = 0;
+        block->context = 0;
+        block->size = header + insize;
     }
+    block->rle = block->sym_count > 1 &&
+        header + 2 * count_runs(input, insize) < block->size;
+    if(stats) {
+        lap(&stats->histogram_ns, &time);
+    }
+}
 
-    destroy_decoder_tree(dtree);
-    return output;
+
+// everything but the timings, which are taken on the way
+static void fill_stats(size_t insize, block_encoder* block, uchar* output,
+        size_t outsize, huffman_stats* stats) {
+    uchar* flags = output + 1;
+    while(*flags++ & 0x80); // the size varint ends with a byte below 0x80
+
+    memcpy(stats->lengths, block->lengths, sizeof(block->lengths));
+    stats->mode = *flags == BLOCK_STORED ? HUFFMAN_BLOCK_STORED :
+        *flags == BLOCK_RLE ? HUFFMAN_BLOCK_RLE :
+        *flags == BLOCK_CONTEXT ? HUFFMAN_BLOCK_CONTEXT : HUFFMAN_BLOCK_CODED;
+    stats->header_bytes = flags + 1 - output;
+    if(stats->mode == HUFFMAN_BLOCK_CONTEXT) {
+        stats->header_bytes += context_header_size(block);
+    } else if(stats->mode == HUFFMAN_BLOCK_CODED) {
+        stats->header_bytes += lengths_size(block->lengths) +
+            (block->interleaved ?
+             (STREAM_COUNT - 1) * jump_entry_size(insize) : 0);
+    }
+    stats->payload_bytes = outsize - stats->header_bytes;
+    stats->bits_per_symbol = 8.0 * stats->payload_bytes / insize;
+
+    stats->entropy = 0;
+    for(int i = 0; i < 256; ++i) {
+        if(stats->histogram[i]) {
+            double p = (double) stats->histogram[i] / insize;
+            stats->entropy -= p * log2(p);
+        }
+    }
+}
+
+
+// output must have block->size bytes, returns the size actually written
+static size_t write_block(uchar* input, size_t insize, block_encoder* block,
+        uchar* output) {
+    uchar* ptr = output;
+
+    *ptr++ = FORMAT_VERSION;
+    write_varint(&ptr, insize); // store input data size
+    uchar* flags = ptr++;
+
+    if(block->rle) {
+        size_t size = encode_runs(input, insize, ptr,
+                block->size - (ptr - output));
+        if(size) {
+            *flags = BLOCK_RLE;
+            return ptr + size - output;
+        }
+    }
+    if(block->stored) {
+        *flags = BLOCK_STORED;
+        memcpy(ptr, input, insize);
+        return ptr + insize - output;
+    }
+
+    if(block->shared) {
+        *flags = BLOCK_SHARED;
+        return ptr + encode_data(input, ptr, insize,
+                block->size - (ptr - output), (symbol_code*) block->shared) -
+            output;
+    }
+    if(block->context) {
+        *flags = BLOCK_CONTEXT;
+        *ptr++ = block->table_count;
+        bit_stream stream = { ptr, 0, 0 };
+        for(int i = 0; i < 256; ++i) {
+            symbol_code entry = { block->context_map[i],
+                context_map_width(block->table_count) };
+            write_code(&stream, &entry);
+        }
+        flush_stream(&stream);
+        ptr = stream.byte;
+        for(int i = 0; i < block->table_count; ++i) {
+            write_lengths(block->table_lengths[i], &ptr);
+        }
+        return ptr + encode_context_data(input, ptr, insize,
+                block->size - (ptr - output), block) - output;
+    }
+
+    *flags = block->interleaved ? BLOCK_INTERLEAVED : 0;
+    write_lengths(block->lengths, &ptr);
+
+    if(block->interleaved) {
+        // every stream codes its own quarter of the data, the jump table
+        // holds the sizes of all the streams but the last one
+        uchar* jump_table = ptr;
+        int entry_size = jump_entry_size(insize);
+        size_t segment = (insize + STREAM_COUNT - 1) / STREAM_COUNT;
+        ptr += (STREAM_COUNT - 1) * entry_size;
+        for(int i = 0; i < STREAM_COUNT; ++i) {
+            size_t size = i < STREAM_COUNT - 1 ?
+                segment : insize - i * segment;
+            size_t stream_size = encode_data(input + i * segment, ptr, size,
+                    block->size - (ptr - output), block->encoder);
+            if(i < STREAM_COUNT - 1 && entry_size == 8) {
+                write_le64(jump_table + 8 * i, stream_size);
+            } else if(i < STREAM_COUNT - 1) {
+                write_le32(jump_table + 4 * i, (uint) stream_size);
+            }
+            ptr += stream_size;
+        }
+    } else if(block->sym_count > 1) {
+        ptr += encode_data(input, ptr, insize, block->size - (ptr - output),
+                block->encoder);
+    }
+    return ptr - output;
+}
+
+
+size_t huffman_compress_bound(size_t insize) {
+    // data which doesn't shrink is stored as is
+    return insize + MAX_BLOCK_OVERHEAD;
+}
+
+
+uchar* huffman_compress(uchar* input, size_t insize, size_t* outsize) {
+    return huffman_compress_ex(input, insize, outsize, NULL);
+}
+
+
+uchar* huffman_compress_ex(uchar* input, size_t insize, size_t* outsize,
+        const huffman_options* options) {
+    if(!input) {
+        return NULL;
+    }
+    if(!outsize) {
+        return NULL;
+    }
+    if(insize == 0) {
+        return NULL;
+    }
+
+    huffman_options defaults;
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!valid_block_options(options)) {
+        return NULL;
+    }
+
+    block_encoder block;
+    worker_pool* pool = count_pool(insize, options);
+    prepare_block(input, insize, options, pool, &block, NULL);
+    pool_destroy(pool);
+    uchar* output = (uchar*) malloc(block.size);
+    *outsize = write_block(input, insize, &block, output);
+    if(*outsize < block.size) { // runs or interleaved streams took less
+        output = (uchar*) realloc(output, *outsize);
+    }
+    return output;
+}
+
+
+int huffman_compress_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options) {
+    return huffman_compress_stats(input, insize, output, capacity, outsize,
+            options, NULL);
+}
+
+
+// options are valid, the pool counts the bytes when it's given
+static int compress_block(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options,
+        worker_pool* pool, huffman_stats* stats) {
+    huffman_stats measured;
+    if(stats) {
+        memset(&measured, 0, sizeof(measured));
+    }
+    block_encoder block;
+    prepare_block(input, insize, options, pool, &block,
+            stats ? &measured : NULL);
+    if(block.size > capacity) {
+        return 0;
+    }
+    uint64_t time = stats ? clock_ns() : 0;
+    *outsize = write_block(input, insize, &block, output);
+    if(stats) {
+        lap(&measured.encode_ns, &time);
+        fill_stats(insize, &block, output, *outsize, &measured);
+        *stats = measured;
+    }
+    return 1;
+}
+
+
+int huffman_compress_stats(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options,
+        huffman_stats* stats) {
+    if(!input || !output || !outsize || insize == 0) {
+        return 0;
+    }
+
+    huffman_options defaults;
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!valid_block_options(options)) {
+        return 0;
+    }
+
+    worker_pool* pool = count_pool(insize, options);
+    int success = compress_block(input, insize, output, capacity, outsize,
+            options, pool, stats);
+    pool_destroy(pool);
+    return success;
+}
+
+
+/* Decoders never read past the input size they are given, so broken or
+ * hostile data costs no more than a failed call. The fast loops load
+ * whole words while at least 8 bytes of the input are left and decode
+ * 3 symbols per load; the tails take the rest a byte at a time, only
+ * when the current code needs it, and fail when the input ends first. */
+
+typedef struct {
+    uchar* input;  // next byte to load
+    size_t left;   // bytes from input to the end of the data
+    uint64_t bits; // loaded bits, the next one is the lowest
+    int bit_count;
+} bit_reader;
+
+
+// at least 8 bytes must be left
+static void refill(bit_reader* reader) {
+    int bytes = (63 - reader->bit_count) >> 3;
+    reader->bits |= read_le64(reader->input) << reader->bit_count;
+    reader->input += bytes;
+    reader->left -= bytes;
+    reader->bit_count |= 56;
+}
+
+
+// returns 0 if the data has ended
+static int load_byte(bit_reader* reader) {
+    if(!reader->left) {
+        return 0;
+    }
+    reader->bits |= (uint64_t) *reader->input++ << reader->bit_count;
+    reader->left--;
+    reader->bit_count += 8;
+    return 1;
+}
+
+
+static uchar decode_symbol(decoder_entry* entries, uint mask,
+        bit_reader* reader) {
+    decoder_entry entry = entries[reader->bits & mask];
+    reader->bits >>= entry.length;
+    reader->bit_count -= entry.length;
+    return entry.symbol;
+}
+
+
+// symbols left to the fast loop: every symbol takes at least min_length
+// bits, so whole 8-byte loads stay inside valid data even when its size
+// is unknown (huffman_decompress)
+static size_t fast_symbols(size_t outsize, int min_length) {
+    size_t slack = (128 + min_length - 1) / min_length;
+    return outsize > slack ? outsize - slack : 0;
+}
+
+
+// returns 0 if the data ends before the output is filled
+static int decode_tail(bit_reader* reader, uchar* output, uchar* output_end,
+        decoder_table* table) {
+    uint mask = (1u << table->max_length) - 1;
+    while(output < output_end) {
+        decoder_entry entry = table->entries[reader->bits & mask];
+        if(entry.length > reader->bit_count) {
+            if(!load_byte(reader)) {
+                return 0;
+            }
+            continue;
+        }
+        reader->bits >>= entry.length;
+        reader->bit_count -= entry.length;
+        *output++ = entry.symbol;
+    }
+    return 1;
+}
+
+
+KERNEL int decode_data_body(uchar* input, size_t insize, uchar* output,
+        size_t outsize, decoder_table* table) {
+    decoder_entry* entries = table->entries;
+    uint mask = (1u << table->max_length) - 1;
+    uchar* output_end = output + outsize;
+    uchar* end = output + fast_symbols(outsize, table->min_length);
+    bit_reader reader = { input, insize, 0, 0 };
+
+    while(output < end && reader.left >= 8) {
+        refill(&reader);
+        // 56 bits always hold 3 codes
+        output[0] = decode_symbol(entries, mask, &reader);
+        output[1] = decode_symbol(entries, mask, &reader);
+        output[2] = decode_symbol(entries, mask, &reader);
+        output += 3;
+    }
+    return decode_tail(&reader, output, output_end, table);
+}
+
+
+static int decode_data(uchar* input, size_t insize, uchar* output,
+        size_t outsize, decoder_table* table) {
+    return kernels.decode_data(input, insize, output, outsize, table);
+}
+
+
+// the streams advance together, so their bit position dependency
+// chains are independent and overlap in the pipeline; returns 0 if the
+// jump table points past the input or a stream ends too early
+KERNEL int decode_data_interleaved_body(uchar* input, size_t insize,
+        uchar* output, size_t outsize, decoder_table* table) {
+    decoder_entry* entries = table->entries;
+    uint mask = (1u << table->max_length) - 1;
+    size_t segment = (outsize + STREAM_COUNT - 1) / STREAM_COUNT;
+    int entry_size = jump_entry_size(outsize);
+    bit_reader readers[STREAM_COUNT];
+    uchar* outputs[STREAM_COUNT];
+
+    size_t jump_table = (STREAM_COUNT - 1) * entry_size;
+    if(insize < jump_table) {
+        return 0;
+    }
+    uchar* stream = input + jump_table;
+    size_t left = insize - jump_table;
+    for(int i = 0; i < STREAM_COUNT; ++i) {
+        uint64_t size = i == STREAM_COUNT - 1 ? left : entry_size == 8 ?
+            read_le64(input + 8 * i) : read_le32(input + 4 * i);
+        if(size > left) {
+            return 0;
+        }
+        readers[i].input = stream;
+        readers[i].left = (size_t) size;
+        readers[i].bits = 0;
+        readers[i].bit_count = 0;
+        outputs[i] = output + i * segment;
+        if(i < STREAM_COUNT - 1) {
+            stream += size;
+            left -= size;
+        }
+    }
+
+    // the last stream is the shortest one
+    size_t last = outsize - (STREAM_COUNT - 1) * segment;
+    uchar* end = outputs[STREAM_COUNT - 1] +
+        fast_symbols(last, table->min_length);
+
+    while(outputs[STREAM_COUNT - 1] < end && readers[0].left >= 8 &&
+            readers[1].left >= 8 && readers[2].left >= 8 &&
+            readers[3].left >= 8) {
+        refill(&readers[0]);
+        refill(&readers[1]);
+        refill(&readers[2]);
+        refill(&readers[3]);
+        for(int k = 0; k < 3; ++k) { // 56 bits always hold 3 codes
+            outputs[0][k] = decode_symbol(entries, mask, &readers[0]);
+            outputs[1][k] = decode_symbol(entries, mask, &readers[1]);
+            outputs[2][k] = decode_symbol(entries, mask, &readers[2]);
+            outputs[3][k] = decode_symbol(entries, mask, &readers[3]);
+        }
+        outputs[0] += 3;
+        outputs[1] += 3;
+        outputs[2] += 3;
+        outputs[3] += 3;
+    }
+
+    for(int i = 0; i < STREAM_COUNT; ++i) {
+        uchar* stream_end = i < STREAM_COUNT - 1 ?
+            output + (i + 1) * segment : output + outsize;
+        if(!decode_tail(&readers[i], outputs[i], stream_end, table)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int decode_data_interleaved(uchar* input, size_t insize,
+        uchar* output, size_t outsize, decoder_table* table) {
+    return kernels.decode_data_interleaved(input, insize, output, outsize,
+            table);
+}
+
+
+/* The loops which take most of the time are built once for any CPU and
+ * again for BMI2, whose shifts by a register count neither wait for the
+ * flags nor go through cl, and for AVX2, which also compares 32 neighbour
+ * pairs at once when counting runs. The best set the CPU has is picked
+ * when the library is loaded, so one build runs at full speed on all of
+ * x86-64; other targets only have the generic set. */
+
+#define KERNELS(suffix, attributes) \
+    attributes static void count_chunk_##suffix(const uchar* input, \
+            size_t size, uint64_t* counts) { \
+        count_chunk_body(input, size, counts); \
+    } \
+    attributes static size_t encode_data_##suffix(uchar* input, \
+            uchar* output, size_t insize, size_t outsize, \
+            symbol_code* encoder) { \
+        return encode_data_body(input, output, insize, outsize, encoder); \
+    } \
+    attributes static int decode_data_##suffix(uchar* input, size_t insize, \
+            uchar* output, size_t outsize, decoder_table* table) { \
+        return decode_data_body(input, insize, output, outsize, table); \
+    } \
+    attributes static int decode_data_interleaved_##suffix(uchar* input, \
+            size_t insize, uchar* output, size_t outsize, \
+            decoder_table* table) { \
+        return decode_data_interleaved_body(input, insize, output, outsize, \
+                table); \
+    }
+
+KERNELS(generic, )
+
+static kernel_set kernels = {
+    "generic", count_chunk_generic, count_runs_generic, encode_data_generic,
+    decode_data_generic, decode_data_interleaved_generic
+};
+
+#ifdef KERNEL_DISPATCH
+KERNELS(bmi2, TARGET("bmi2"))
+KERNELS(avx2, TARGET("avx2,bmi2"))
+
+TARGET("avx2,bmi2,popcnt")
+static size_t count_runs_avx2(const uchar* input, size_t size) {
+    size_t runs = 1, i = 1;
+    for(; i + 32 <= size; i += 32) {
+        // a bit of every pair of equal bytes
+        __m256i next = _mm256_loadu_si256((const __m256i*) (input + i));
+        __m256i previous = _mm256_loadu_si256(
+                (const __m256i*) (input + i - 1));
+        uint equal = (uint) _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(next, previous));
+        runs += 32 - _mm_popcnt_u32(equal);
+    }
+    return runs - 1 + count_runs_generic(input + i - 1, size - i + 1);
+}
+
+static const kernel_set bmi2_kernels = {
+    "bmi2", count_chunk_bmi2, count_runs_generic, encode_data_bmi2,
+    decode_data_bmi2, decode_data_interleaved_bmi2
+};
+
+static const kernel_set avx2_kernels = {
+    "avx2", count_chunk_avx2, count_runs_avx2, encode_data_avx2,
+    decode_data_avx2, decode_data_interleaved_avx2
+};
+
+
+#define CPU_BMI2 1
+#define CPU_AVX2 2
+
+// AVX2 also needs the OS to save the 256-bit registers on a switch
+static int cpu_features(void) {
+    uint eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    int avx = 0;
+    if((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+        uint low, high;
+        __asm__("xgetbv" : "=a" (low), "=d" (high) : "c" (0));
+        avx = (low & 6) == 6; // SSE and AVX state
+    }
+
+    int features = 0;
+    if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        features |= ebx & bit_BMI2 ? CPU_BMI2 : 0;
+        features |= avx && (ebx & bit_AVX2) ? CPU_AVX2 : 0;
+    }
+    return features;
+}
+
+
+__attribute__((constructor)) static void select_kernels(void) {
+    int features = cpu_features();
+    if((features & CPU_AVX2) && (features & CPU_BMI2)) {
+        kernels = avx2_kernels;
+    } else if(features & CPU_BMI2) {
+        kernels = bmi2_kernels;
+    }
+}
+#endif
+
+
+const char* huffman_kernels(void) {
+    return kernels.name;
+}
+
+
+// order-1 codes: the table of every symbol is picked by the one before it
+static int decode_context_data(uchar* input, size_t insize, uchar* output,
+        size_t outsize, decoder_table* tables, const uchar* context_map) {
+    decoder_entry* entries[256]; // by the previous byte
+    uint masks[256];
+    int min_length = MAX_CODE_LENGTH;
+    for(int i = 0; i < 256; ++i) {
+        entries[i] = tables[context_map[i]].entries;
+        masks[i] = (1u << tables[context_map[i]].max_length) - 1;
+        min_length = tables[context_map[i]].min_length < min_length ?
+            tables[context_map[i]].min_length : min_length;
+    }
+    uchar* output_end = output + outsize;
+    uchar* end = output + fast_symbols(outsize, min_length);
+    bit_reader reader = { input, insize, 0, 0 };
+    uchar previous = 0;
+
+    while(output < end && reader.left >= 8) {
+        refill(&reader);
+        for(int k = 0; k < 3; ++k) { // 56 bits always hold 3 codes
+            previous = decode_symbol(entries[previous], masks[previous],
+                    &reader);
+            *output++ = previous;
+        }
+    }
+
+    // same as decode_tail
+    while(output < output_end) {
+        decoder_entry entry =
+            entries[previous][reader.bits & masks[previous]];
+        if(entry.length > reader.bit_count) {
+            if(!load_byte(&reader)) {
+                return 0;
+            }
+            continue;
+        }
+        reader.bits >>= entry.length;
+        reader.bit_count -= entry.length;
+        previous = *output++ = entry.symbol;
+    }
+    return 1;
+}
+
+
+// parses the version and the data size, returns the size of the
+// header or 0 if it's broken
+static int read_block_size(uchar* input, size_t insize, uint64_t* size) {
+    if(insize < 1 || input[0] != FORMAT_VERSION) {
+        return 0;
+    }
+    int varint = read_varint(input + 1, insize - 1, size);
+    if(!varint || *size == 0 || *size > SIZE_MAX) {
+        return 0;
+    }
+    return 1 + varint;
+}
+
+
+// returns 0 if the runs are broken or don't fill the output exactly
+static int decode_runs(const uchar* input, size_t insize, uchar* output,
+        size_t outsize) {
+    size_t read = 0, written = 0;
+    while(written < outsize) {
+        uint64_t run;
+        int varint = insize - read < 2 ? 0 :
+            read_varint(input + read + 1, insize - read - 1, &run);
+        if(!varint || run >= outsize - written) {
+            return 0;
+        }
+        memset(output + written, input[read], (size_t) run + 1);
+        written += (size_t) run + 1;
+        read += 1 + varint;
+    }
+    return 1;
+}
+
+
+// whether a complete code lengths header is in the size bytes
+static int lengths_fit(const uchar* input, size_t size) {
+    return size >= 2 && (input[0] >= input[1] || (size >= 3 &&
+                size >= 3 + ((input[1] - input[0] + 1) * input[2] + 7) / 8u));
+}
+
+
+// table count, context map and code lengths of all the tables
+static int decompress_context(uchar* input, size_t insize, uchar* output,
+        size_t outsize) {
+    uchar* ptr = input;
+    if(insize < 1 || *ptr < 2 || *ptr > MAX_CONTEXT_TABLES) {
+        return 0;
+    }
+    int table_count = *ptr++;
+    int width = context_map_width(table_count);
+    if(insize - 1 < 256 * width / 8u) {
+        return 0;
+    }
+    uchar context_map[256];
+    for(int i = 0, bit = 0; i < 256; ++i) {
+        context_map[i] = 0;
+        for(int k = 0; k < width; ++k, ++bit) {
+            context_map[i] |= ((ptr[bit / 8] >> (bit % 8)) & 1) << k;
+        }
+        if(context_map[i] >= table_count) {
+            return 0;
+        }
+    }
+    ptr += 256 * width / 8;
+
+    decoder_table* tables =
+        (decoder_table*) malloc(table_count * sizeof(decoder_table));
+    if(!tables) {
+        return 0;
+    }
+    for(int j = 0; j < table_count; ++j) {
+        uchar lengths[256];
+        int sym_count = lengths_fit(ptr, insize - (ptr - input)) ?
+            read_lengths(&ptr, lengths) : -1;
+        if(sym_count < 0) {
+            free(tables);
+            return 0;
+        }
+        build_decoder_table(lengths, tables + j);
+        if(sym_count == 1) {
+            // the only code is a zero bit, the other entry is filled too
+            // so that broken data decodes nothing undefined
+            tables[j].entries[1] = tables[j].entries[0];
+        }
+    }
+    int success = decode_context_data(ptr, insize - (ptr - input), output,
+            outsize, tables, context_map);
+    free(tables);
+    return success;
+}
+
+
+// nothing past insize bytes of the input is read, broken data fails;
+// shared is the table of the batch of the block or NULL
+static int decompress_block(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, decoder_table* shared) {
+    uint64_t size;
+    int header = read_block_size(input, insize, &size);
+    if(!header || insize - header < 1 || size > capacity) {
+        return 0;
+    }
+    *outsize = (size_t) size;
+    uchar* ptr = input + header;
+
+    int flags = *ptr++;
+    size_t left = insize - (ptr - input);
+    if(flags == BLOCK_STORED) {
+        if(left < *outsize) {
+            return 0;
+        }
+        memcpy(output, ptr, *outsize);
+        return 1;
+    }
+    if(flags == BLOCK_RLE) {
+        return decode_runs(ptr, left, output, *outsize);
+    }
+    if(flags == BLOCK_CONTEXT) {
+        return decompress_context(ptr, left, output, *outsize);
+    }
+    if(flags == BLOCK_SHARED) {
+        return shared && decode_data(ptr, left, output, *outsize, shared);
+    }
+    if((flags & ~BLOCK_INTERLEAVED) ||
+            ((flags & BLOCK_INTERLEAVED) && *outsize < INTERLEAVED_MIN_SIZE)) {
+        return 0;
+    }
+    if(!lengths_fit(ptr, left)) {
+        return 0;
+    }
+    uchar lengths[256];
+    int sym_count = read_lengths(&ptr, lengths);
+    if(sym_count < 0) {
+        return 0;
+    }
+
+    if(sym_count == 1) { // special case when there's only one symbol
+        int symbol = 0;
+        while(!lengths[symbol]) {
+            symbol++;
+        }
+        memset(output, symbol, *outsize);
+        return 1;
+    }
+
+    decoder_table table;
+    build_decoder_table(lengths, &table);
+    left = insize - (ptr - input);
+    if(flags & BLOCK_INTERLEAVED) {
+        return decode_data_interleaved(ptr, left, output, *outsize, &table);
+    }
+    return decode_data(ptr, left, output, *outsize, &table);
+}
+
+
+size_t huffman_decompressed_size(uchar* input, size_t insize) {
+    uint64_t size;
+    if(!input || !read_block_size(input, insize, &size)) {
+        return 0;
+    }
+    return (size_t) size;
+}
+
+
+int huffman_decompress_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize) {
+    if(!input || !output || !outsize) {
+        return 0;
+    }
+    return decompress_block(input, insize, output, capacity, outsize, NULL);
+}
+
+
+uchar* huffman_decompress(uchar* input) {
+    if(input == NULL) {
+        return NULL;
+    }
+
+    // size of the input is unknown here
+    size_t outsize = huffman_decompressed_size(input, SIZE_MAX);
+    if(outsize == 0) {
+        return NULL;
+    }
+
+    uchar* output = (uchar*) malloc(outsize);
+    if(!output || !decompress_block(input, SIZE_MAX, output, outsize,
+                &outsize, NULL)) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+
+/* A codebook is a code of all the 256 bytes trained once on sample data.
+ * Messages coded with it carry no code lengths, only the id of the
+ * codebook and the size of the data, both as varints. */
+
+#define CODEBOOK_VERSION 1
+
+struct huffman_codebook {
+    uint id;
+    uchar lengths[256];
+    uchar max_length;
+    symbol_code encoder[256];
+    decoder_table decoder;
+};
+
+
+static huffman_codebook* create_codebook(uint id, uchar* lengths) {
+    huffman_codebook* codebook =
+        (huffman_codebook*) malloc(sizeof(huffman_codebook));
+    codebook->id = id;
+    memcpy(codebook->lengths, lengths, 256);
+    memset(codebook->encoder, 0, sizeof(codebook->encoder));
+    fill_encoder(lengths, codebook->encoder);
+    build_decoder_table(lengths, &codebook->decoder);
+    codebook->max_length = codebook->decoder.max_length;
+    return codebook;
+}
+
+
+huffman_codebook* huffman_train_codebook(const uchar* samples, size_t size,
+        uint id, const huffman_options* options) {
+    symbol_frequency freqs[256];
+    uint64_t counts[256];
+    uchar lengths[256];
+    huffman_options defaults;
+    if(!samples && size) {
+        return NULL;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!valid_block_options(options)) {
+        return NULL;
+    }
+
+    // bytes missing in the samples still get a (long) code
+    worker_pool* pool = count_pool(size, options);
+    count_symbols_parallel(samples, size, counts, pool, options->threads);
+    pool_destroy(pool);
+    for(int i = 0; i < 256; ++i) {
+        counts[i]++;
+    }
+    int count = sort_frequencies(counts, freqs);
+    code_lengths(freqs, count, options->max_code_length, lengths);
+    return create_codebook(id, lengths);
+}
+
+
+uchar* huffman_save_codebook(const huffman_codebook* codebook,
+        size_t* outsize) {
+    if(!codebook || !outsize) {
+        return NULL;
+    }
+    uchar* output = (uchar*) malloc(1 + MAX_VARINT_SIZE + MAX_LENGTHS_SIZE);
+    uchar* ptr = output;
+    *ptr++ = CODEBOOK_VERSION;
+    write_varint(&ptr, codebook->id);
+    write_lengths((uchar*) codebook->lengths, &ptr);
+    *outsize = ptr - output;
+    return output;
+}
+
+
+huffman_codebook* huffman_load_codebook(const uchar* data, size_t size) {
+    uint64_t id;
+    uchar lengths[256];
+    if(!data || size < 1 || data[0] != CODEBOOK_VERSION) {
+        return NULL;
+    }
+    int varint = read_varint(data + 1, size - 1, &id);
+    if(!varint || id > UINT32_MAX) {
+        return NULL;
+    }
+
+    // every byte has a code
+    uchar* ptr = (uchar*) data + 1 + varint;
+    if(size - (ptr - data) < MAX_LENGTHS_SIZE || ptr[0] != 0 ||
+            ptr[1] != 255 || read_lengths(&ptr, lengths) != 256) {
+        return NULL;
+    }
+    return create_codebook((uint) id, lengths);
+}
+
+
+void huffman_destroy_codebook(huffman_codebook* codebook) {
+    free(codebook);
+}
+
+
+uint huffman_codebook_id(const huffman_codebook* codebook) {
+    return codebook->id;
+}
+
+
+size_t huffman_codebook_bound(const huffman_codebook* codebook,
+        size_t insize) {
+    return 2 * MAX_VARINT_SIZE +
+        (insize / 8 * codebook->max_length) + codebook->max_length;
+}
+
+
+int huffman_compress_with(const huffman_codebook* codebook, uchar* input,
+        size_t insize, uchar* output, size_t capacity, size_t* outsize) {
+    uchar header[2 * MAX_VARINT_SIZE], *ptr = header;
+    if(!codebook || (!input && insize) || !output || !outsize) {
+        return 0;
+    }
+
+    uint64_t data_bits = 0;
+    for(size_t i = 0; i < insize; ++i) {
+        data_bits += codebook->encoder[input[i]].bit_length;
+    }
+    write_varint(&ptr, codebook->id);
+    write_varint(&ptr, insize);
+    size_t size = (ptr - header) + (size_t) ((data_bits + 7) / 8);
+    if(size > capacity) {
+        return 0;
+    }
+
+    memcpy(output, header, ptr - header);
+    *outsize = (ptr - header) + encode_data(input, output + (ptr - header),
+            insize, size - (ptr - header), (symbol_code*) codebook->encoder);
+    return 1;
+}
+
+
+// returns the size of the message header or 0 if it's broken
+static int read_message_header(const huffman_codebook* codebook,
+        uchar* input, size_t insize, uint64_t* size) {
+    uint64_t id;
+    int id_size = read_varint(input, insize, &id);
+    if(!id_size || id != codebook->id) {
+        return 0;
+    }
+    int size_size = read_varint(input + id_size, insize - id_size, size);
+    if(!size_size || *size > SIZE_MAX) {
+        return 0;
+    }
+    return id_size + size_size;
+}
+
+
+size_t huffman_decompressed_size_with(const huffman_codebook* codebook,
+        uchar* input, size_t insize) {
+    uint64_t size;
+    if(!codebook || !input ||
+            !read_message_header(codebook, input, insize, &size)) {
+        return 0;
+    }
+    return (size_t) size;
+}
+
+
+int huffman_decompress_with(const huffman_codebook* codebook, uchar* input,
+        size_t insize, uchar* output, size_t capacity, size_t* outsize) {
+    uint64_t size;
+    if(!codebook || !input || !outsize) {
+        return 0;
+    }
+    int header = read_message_header(codebook, input, insize, &size);
+    if(!header || size > capacity || (size && !output)) {
+        return 0;
+    }
+    *outsize = (size_t) size;
+    return decode_data(input + header, insize - header, output, *outsize,
+            (decoder_table*) &codebook->decoder);
+}
+
+
+/* A batch packs many small records into one output: record i takes the
+ * bytes from offsets[i] to offsets[i + 1] and an empty record takes none.
+ * Every record is a block of its own. With options->batch_table the
+ * output starts with the format version and the code lengths of the
+ * whole batch, and the records are coded with this code, so they are
+ * neither counted nor sorted one by one and carry no code lengths; each
+ * of them is still stored or coded as runs when that's cheaper. */
+
+#define MAX_BATCH_TABLE_SIZE (1 + MAX_LENGTHS_SIZE)
+
+
+size_t huffman_compress_batch_bound(const size_t* sizes, size_t count) {
+    size_t bound = MAX_BATCH_TABLE_SIZE;
+    for(size_t i = 0; i < count; ++i) {
+        bound += sizes[i] ? huffman_compress_bound(sizes[i]) : 0;
+    }
+    return bound;
+}
+
+
+// record of a batch coded with the table of the batch
+static void prepare_shared_block(uchar* input, size_t insize,
+        const symbol_code* code, block_encoder* block) {
+    uint64_t data_bits = 0;
+    for(size_t i = 0; i < insize; ++i) {
+        data_bits += code[input[i]].bit_length;
+    }
+
+    uchar varint[MAX_VARINT_SIZE], *end = varint;
+    write_varint(&end, insize);
+    size_t header = 2 + (end - varint);
+    block->shared = code;
+    block->interleaved = 0;
+    block->context = 0;
+    block->size = header + (size_t) ((data_bits + 7) / 8);
+    block->stored = block->size >= header + insize;
+    if(block->stored) {
+        block->size = header + insize;
+    }
+    block->rle = header + 2 * count_runs(input, insize) < block->size;
+}
+
+
+int huffman_compress_batch(uchar* const* inputs, const size_t* sizes,
+        size_t count, uchar* output, size_t capacity, size_t* offsets,
+        const huffman_options* options) {
+    if(!inputs || !sizes || !output || !offsets) {
+        return 0;
+    }
+    huffman_options defaults;
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!valid_block_options(options)) {
+        return 0;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        if(!inputs[i] && sizes[i]) {
+            return 0;
+        }
+    }
+
+    uchar* ptr = output;
+    symbol_code code[256];
+    uint64_t counts[256] = { 0 };
+    int shared = 0;
+    if(options->batch_table) {
+        symbol_frequency freqs[256];
+        uchar lengths[256], table[MAX_BATCH_TABLE_SIZE], *end = table;
+        for(size_t i = 0; i < count; ++i) {
+            for(size_t j = 0; j < sizes[i]; ++j) {
+                counts[inputs[i][j]]++;
+            }
+        }
+        // a batch of empty records has nothing to code
+        int sym_count = sort_frequencies(counts, freqs);
+        shared = sym_count > 0;
+        if(shared) {
+            code_lengths(freqs, sym_count, options->max_code_length,
+                    lengths);
+            memset(code, 0, sizeof(code));
+            fill_encoder(lengths, code);
+            *end++ = FORMAT_VERSION;
+            write_lengths(lengths, &end);
+            if((size_t) (end - table) > capacity) {
+                return 0;
+            }
+            memcpy(ptr, table, end - table);
+            ptr += end - table;
+        }
+    }
+
+    // large records are counted by the threads of one pool for the batch
+    size_t largest = 0;
+    for(size_t i = 0; i < count && !shared; ++i) {
+        largest = sizes[i] > largest ? sizes[i] : largest;
+    }
+    worker_pool* pool = count_pool(largest, options);
+
+    block_encoder block;
+    int success = 1;
+    for(size_t i = 0; i < count && success; ++i) {
+        offsets[i] = ptr - output;
+        if(!sizes[i]) {
+            continue;
+        }
+        size_t left = capacity - (ptr - output), size = 0;
+        if(shared) {
+            prepare_shared_block(inputs[i], sizes[i], code, &block);
+            success = block.size <= left;
+            if(success) {
+                size = write_block(inputs[i], sizes[i], &block, ptr);
+            }
+        } else {
+            success = compress_block(inputs[i], sizes[i], ptr, left, &size,
+                    options, pool, NULL);
+        }
+        ptr += size;
+    }
+    pool_destroy(pool);
+    offsets[count] = ptr - output;
+    return success;
+}
+
+
+size_t huffman_decompressed_size_batch(uchar* input, const size_t* offsets,
+        size_t count) {
+    size_t total = 0;
+    if(!input || !offsets) {
+        return 0;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        if(offsets[i + 1] < offsets[i]) {
+            return 0;
+        }
+        if(offsets[i + 1] == offsets[i]) {
+            continue;
+        }
+        size_t size = huffman_decompressed_size(input + offsets[i],
+                offsets[i + 1] - offsets[i]);
+        if(!size || total + size < total) {
+            return 0;
+        }
+        total += size;
+    }
+    return total;
+}
+
+
+// the code of the batch, which must take all the size bytes
+static decoder_table* read_batch_table(uchar* input, size_t size) {
+    uchar lengths[256], *ptr = input + 1;
+    if(size < 1 || input[0] != FORMAT_VERSION ||
+            !lengths_fit(ptr, size - 1)) {
+        return NULL;
+    }
+    int sym_count = read_lengths(&ptr, lengths);
+    decoder_table* table = sym_count > 0 && (size_t) (ptr - input) == size ?
+        (decoder_table*) malloc(sizeof(decoder_table)) : NULL;
+    if(table) {
+        build_decoder_table(lengths, table);
+        if(sym_count == 1) { // the only code is a zero bit
+            table->entries[1] = table->entries[0];
+        }
+    }
+    return table;
+}
+
+
+int huffman_decompress_batch(uchar* input, const size_t* offsets,
+        size_t count, uchar* output, size_t capacity,
+        size_t* output_offsets) {
+    if(!input || !offsets || !output || !output_offsets) {
+        return 0;
+    }
+    decoder_table* table = NULL;
+    if(offsets[0]) {
+        table = read_batch_table(input, offsets[0]);
+        if(!table) {
+            return 0;
+        }
+    }
+
+    size_t written = 0;
+    int success = 1;
+    for(size_t i = 0; i < count && success; ++i) {
+        size_t size = 0;
+        output_offsets[i] = written;
+        if(offsets[i + 1] < offsets[i]) {
+            success = 0;
+        } else if(offsets[i + 1] > offsets[i]) {
+            success = decompress_block(input + offsets[i],
+                    offsets[i + 1] - offsets[i], output + written,
+                    capacity - written, &size, table);
+        }
+        written += size;
+    }
+    output_offsets[count] = written;
+    free(table);
+    return success;
+}
+
+
+/* Wide symbols are 16-bit numbers such as samples or dictionary ids.
+ * Their blocks have the same framing with the BLOCK_WIDE flag and the
+ * number of the symbols as the size. A stored block holds them as is,
+ * 2 bytes each, lowest first. The header of a coded block lists only the
+ * symbols which occur: their count, the first one and the gaps between
+ * the next ones minus one as varints, then (for more than one symbol) the
+ * bit width of a length and the packed lengths. The decoder table has as
+ * many entries as the longest code needs. */
+
+#define WIDE_SYMBOLS 65536
+#define WIDE_MAX_CODE_LENGTH 16 // codes of all the symbols fit
+
+
+typedef struct {
+    uint16_t code; // first bit of the code is the lowest one
+    uchar length;
+} wide_code;
+
+
+typedef struct {
+    uint16_t symbol;
+    uchar length;
+} wide_entry;
+
+
+typedef struct {
+    uint16_t symbol;
+    uint64_t frequency;
+} wide_frequency;
+
+
+static int wide_compare_down(const void* a, const void* b) {
+    return compare_frequency(((wide_frequency*) b)->frequency,
+        ((wide_frequency*) a)->frequency);
+}
+
+
+static int wide_compare_symbol(const void* a, const void* b) {
+    return *(uint16_t*) a - *(uint16_t*) b;
+}
+
+
+// canonical codes of the symbols sorted up, ordered by (length, symbol)
+// like those of the bytes
+static void wide_codes(const uchar* lengths, int count, wide_code* codes) {
+    uint counts[WIDE_MAX_CODE_LENGTH + 1] = { 0 };
+    uint next[WIDE_MAX_CODE_LENGTH + 1];
+    for(int i = 0; i < count; ++i) {
+        counts[lengths[i]]++;
+    }
+    uint code = 0;
+    counts[0] = 0;
+    for(int length = 1; length <= WIDE_MAX_CODE_LENGTH; ++length) {
+        code = (code + counts[length - 1]) << 1;
+        next[length] = code;
+    }
+    for(int i = 0; i < count; ++i) {
+        codes[i].length = lengths[i];
+        codes[i].code = (uint16_t) reverse_bits(next[lengths[i]]++,
+                lengths[i]);
+    }
+}
+
+
+size_t huffman_compress_bound_wide(size_t count) {
+    return 2 * count + MAX_BLOCK_OVERHEAD;
+}
+
+
+// symbols which occur sorted up and their code lengths, returns their
+// count or 0 if the memory ran out
+static int wide_code_lengths(const uint16_t* input, size_t count,
+        int max_code_length, uint16_t* symbols, uchar* lengths) {
+    // only the pages of the counters which are used are ever touched
+    uint64_t* counts = (uint64_t*) calloc(WIDE_SYMBOLS, sizeof(uint64_t));
+    wide_frequency* freqs =
+        (wide_frequency*) malloc(WIDE_SYMBOLS * sizeof(wide_frequency));
+    uint64_t* frequencies =
+        (uint64_t*) calloc(WIDE_SYMBOLS, sizeof(uint64_t));
+    uchar* rank_lengths = (uchar*) malloc(WIDE_SYMBOLS);
+    int symbol_count = 0;
+    if(!counts || !freqs || !frequencies || !rank_lengths) {
+        goto done;
+    }
+
+    for(size_t i = 0; i < count; ++i) {
+        if(!counts[input[i]]++) {
+            symbols[symbol_count++] = input[i];
+        }
+    }
+    qsort(symbols, symbol_count, sizeof(uint16_t), wide_compare_symbol);
+    if(symbol_count == 1) {
+        lengths[0] = 1;
+        goto done;
+    }
+
+    for(int i = 0; i < symbol_count; ++i) {
+        freqs[i].symbol = symbols[i];
+        freqs[i].frequency = counts[symbols[i]];
+    }
+    qsort(freqs, symbol_count, sizeof(wide_frequency), wide_compare_down);
+    for(int i = 0; i < symbol_count; ++i) {
+        frequencies[i] = freqs[i].frequency;
+    }
+    // codes are longer than the limit only if there are too many symbols
+    int max_length = max_code_length;
+    while((1 << max_length) < symbol_count) {
+        max_length++;
+    }
+    if(!limit_rank_lengths(frequencies, symbol_count, max_length,
+                rank_lengths)) {
+        symbol_count = 0;
+        goto done;
+    }
+
+    // lengths are needed in the order of the symbols, the counters are
+    // free to hold them
+    for(int i = 0; i < symbol_count; ++i) {
+        counts[freqs[i].symbol] = rank_lengths[i];
+    }
+    for(int i = 0; i < symbol_count; ++i) {
+        lengths[i] = (uchar) counts[symbols[i]];
+    }
+
+done:
+    free(counts);
+    free(freqs);
+    free(frequencies);
+    free(rank_lengths);
+    return symbol_count;
+}
+
+
+static int wide_length_width(const uchar* lengths, int count) {
+    int max_length = 0, width;
+    for(int i = 0; i < count; ++i) {
+        max_length = MAX(max_length, lengths[i]);
+    }
+    for(width = 1; (1 << width) <= max_length; ++width);
+    return width;
+}
+
+
+static size_t wide_header_size(const uint16_t* symbols, const uchar* lengths,
+        int count) {
+    uchar varint[MAX_VARINT_SIZE], *end = varint;
+    write_varint(&end, count);
+    write_varint(&end, symbols[0]);
+    size_t size = end - varint;
+    for(int i = 1; i < count; ++i) {
+        end = varint;
+        write_varint(&end, symbols[i] - symbols[i - 1] - 1);
+        size += end - varint;
+    }
+    if(count > 1) {
+        int width = wide_length_width(lengths, count);
+        size += 1 + ((size_t) count * width + 7) / 8;
+    }
+    return size;
+}
+
+
+static void write_wide_header(const uint16_t* symbols, const uchar* lengths,
+        int count, uchar** output) {
+    write_varint(output, count);
+    write_varint(output, symbols[0]);
+    for(int i = 1; i < count; ++i) {
+        write_varint(output, symbols[i] - symbols[i - 1] - 1);
+    }
+    if(count == 1) {
+        return;
+    }
+    int width = wide_length_width(lengths, count);
+    *(*output)++ = width;
+    bit_stream stream = { *output, 0, 0 };
+    for(int i = 0; i < count; ++i) {
+        symbol_code length = { lengths[i], width };
+        write_code(&stream, &length);
+    }
+    flush_stream(&stream);
+    *output = stream.byte;
+}
+
+
+static size_t encode_wide_data(const uint16_t* input, size_t count,
+        uchar* output, size_t outsize, const wide_code* encoder) {
+    uchar* output_end = output + outsize;
+    bit_stream stream = { output, 0, 0 };
+    size_t i = 0;
+    // 3 codes of at most 16 bits fit into 56 bits, the whole word is
+    // stored and the pointer is moved by the complete bytes only
+    for(; i + 3 <= count && output_end - stream.byte >= 8; i += 3) {
+        for(int k = 0; k < 3; ++k) {
+            const wide_code* code = encoder + input[i + k];
+            stream.bits |= (uint64_t) code->code << stream.bit_count;
+            stream.bit_count += code->length;
+        }
+        write_le64(stream.byte, stream.bits);
+        stream.byte += stream.bit_count >> 3;
+        stream.bits >>= stream.bit_count & ~7;
+        stream.bit_count &= 7;
+    }
+    for(; i < count; ++i) {
+        symbol_code code = { encoder[input[i]].code, encoder[input[i]].length };
+        write_code(&stream, &code);
+    }
+    flush_stream(&stream);
+    return stream.byte - output;
+}
+
+
+int huffman_compress_wide(const uint16_t* input, size_t count, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options) {
+    if(!input || !output || !outsize || count == 0 ||
+            count > (SIZE_MAX - MAX_BLOCK_OVERHEAD) / 2) {
+        return 0;
+    }
+    huffman_options defaults;
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!valid_block_options(options)) {
+        return 0;
+    }
+
+    uint16_t* symbols = (uint16_t*) malloc(WIDE_SYMBOLS * sizeof(uint16_t));
+    uchar* lengths = (uchar*) malloc(WIDE_SYMBOLS);
+    wide_code* encoder = (wide_code*) malloc(WIDE_SYMBOLS * sizeof(wide_code));
+    wide_code* codes = (wide_code*) malloc(WIDE_SYMBOLS * sizeof(wide_code));
+    int symbol_count = !symbols || !lengths || !encoder || !codes ? 0 :
+        wide_code_lengths(input, count, options->max_code_length, symbols,
+                lengths);
+    int success = 0;
+    if(!symbol_count) {
+        goto done;
+    }
+
+    uint64_t data_bits = 0;
+    if(symbol_count > 1) {
+        wide_codes(lengths, symbol_count, codes);
+        for(int i = 0; i < symbol_count; ++i) {
+            encoder[symbols[i]] = codes[i];
+        }
+        for(size_t i = 0; i < count; ++i) {
+            data_bits += encoder[input[i]].length;
+        }
+    }
+
+    uchar* ptr = output;
+    uchar varint[MAX_VARINT_SIZE], *end = varint;
+    write_varint(&end, count);
+    size_t header = 2 + (end - varint);
+    size_t size = header + wide_header_size(symbols, lengths, symbol_count) +
+        (size_t) ((data_bits + 7) / 8);
+    int stored = size >= header + 2 * count;
+    if((stored ? header + 2 * count : size) > capacity) {
+        goto done;
+    }
+
+    *ptr++ = FORMAT_VERSION;
+    write_varint(&ptr, count);
+    if(stored) {
+        *ptr++ = BLOCK_WIDE | BLOCK_STORED;
+        for(size_t i = 0; i < count; ++i, ptr += 2) {
+            ptr[0] = (uchar) input[i];
+            ptr[1] = (uchar) (input[i] >> 8);
+        }
+    } else {
+        *ptr++ = BLOCK_WIDE;
+        write_wide_header(symbols, lengths, symbol_count, &ptr);
+        if(symbol_count > 1) {
+            ptr += encode_wide_data(input, count, ptr,
+                    size - (ptr - output), encoder);
+        }
+    }
+    *outsize = ptr - output;
+    success = 1;
+
+done:
+    free(symbols);
+    free(lengths);
+    free(encoder);
+    free(codes);
+    return success;
+}
+
+
+// symbols and code lengths of a coded block, returns the symbol count or
+// 0 if the header is broken; input is moved past the header
+static int read_wide_header(uchar** input, size_t insize, uint16_t* symbols,
+        uchar* lengths) {
+    uchar* ptr = *input, *end = *input + insize;
+    uint64_t count, value;
+    int varint = read_varint(ptr, end - ptr, &count);
+    if(!varint || count == 0 || count > WIDE_SYMBOLS) {
+        return 0;
+    }
+    ptr += varint;
+    for(uint64_t i = 0, symbol = 0; i < count; ++i) {
+        varint = read_varint(ptr, end - ptr, &value);
+        if(!varint || value >= WIDE_SYMBOLS) {
+            return 0;
+        }
+        symbol = i ? symbol + value + 1 : value;
+        if(symbol >= WIDE_SYMBOLS) {
+            return 0;
+        }
+        symbols[i] = (uint16_t) symbol;
+        ptr += varint;
+    }
+    if(count == 1) {
+        lengths[0] = 1;
+        *input = ptr;
+        return 1;
+    }
+
+    int width = ptr < end ? *ptr++ : 0;
+    if(width < 1 || width > 5 ||
+            (size_t) (end - ptr) < (count * width + 7) / 8) {
+        return 0;
+    }
+    uint64_t kraft = 0; // the code must be complete
+    for(uint64_t i = 0, bit = 0; i < count; ++i) {
+        int length = 0;
+        for(int k = 0; k < width; ++k, ++bit) {
+            length |= ((ptr[bit / 8] >> (bit % 8)) & 1) << k;
+        }
+        if(length < 1 || length > WIDE_MAX_CODE_LENGTH) {
+            return 0;
+        }
+        kraft += (uint64_t) 1 << (WIDE_MAX_CODE_LENGTH - length);
+        lengths[i] = length;
+    }
+    if(kraft != (uint64_t) 1 << WIDE_MAX_CODE_LENGTH) {
+        return 0;
+    }
+    *input = ptr + (count * width + 7) / 8;
+    return (int) count;
+}
+
+
+static int decode_wide_data(uchar* input, size_t insize, uint16_t* output,
+        size_t count, const wide_entry* entries, int max_length,
+        int min_length) {
+    uint mask = (1u << max_length) - 1;
+    uint16_t* output_end = output + count;
+    uint16_t* end = output + fast_symbols(count, min_length);
+    bit_reader reader = { input, insize, 0, 0 };
+
+    while(output < end && reader.left >= 8) {
+        refill(&reader);
+        for(int k = 0; k < 3; ++k) { // 56 bits always hold 3 codes
+            wide_entry entry = entries[reader.bits & mask];
+            reader.bits >>= entry.length;
+            reader.bit_count -= entry.length;
+            *output++ = entry.symbol;
+        }
+    }
+
+    // same as decode_tail
+    while(output < output_end) {
+        wide_entry entry = entries[reader.bits & mask];
+        if(entry.length > reader.bit_count) {
+            if(!load_byte(&reader)) {
+                return 0;
+            }
+            continue;
+        }
+        reader.bits >>= entry.length;
+        reader.bit_count -= entry.length;
+        *output++ = entry.symbol;
+    }
+    return 1;
+}
+
+
+size_t huffman_decompressed_size_wide(uchar* input, size_t insize) {
+    uint64_t size;
+    int header = input ? read_block_size(input, insize, &size) : 0;
+    if(!header || insize - header < 1 || !(input[header] & BLOCK_WIDE)) {
+        return 0;
+    }
+    return (size_t) size;
+}
+
+
+int huffman_decompress_wide(uchar* input, size_t insize, uint16_t* output,
+        size_t capacity, size_t* count) {
+    uint64_t size;
+    if(!input || !output || !count) {
+        return 0;
+    }
+    int header = read_block_size(input, insize, &size);
+    if(!header || insize - header < 1 || size > capacity) {
+        return 0;
+    }
+    *count = (size_t) size;
+    uchar* ptr = input + header;
+    int flags = *ptr++;
+    size_t left = insize - (ptr - input);
+
+    if(flags == (BLOCK_WIDE | BLOCK_STORED)) {
+        if(left / 2 < *count) {
+            return 0;
+        }
+        for(size_t i = 0; i < *count; ++i, ptr += 2) {
+            output[i] = ptr[0] | (ptr[1] << 8);
+        }
+        return 1;
+    }
+    if(flags != BLOCK_WIDE) {
+        return 0;
+    }
+
+    uint16_t* symbols = (uint16_t*) malloc(WIDE_SYMBOLS * sizeof(uint16_t));
+    uchar* lengths = (uchar*) malloc(WIDE_SYMBOLS);
+    wide_code* codes = (wide_code*) malloc(WIDE_SYMBOLS * sizeof(wide_code));
+    wide_entry* entries = NULL;
+    int symbol_count = !symbols || !lengths || !codes ? 0 :
+        read_wide_header(&ptr, left, symbols, lengths);
+    int success = 0;
+    if(symbol_count == 1) {
+        for(size_t i = 0; i < *count; ++i) {
+            output[i] = symbols[0];
+        }
+        success = 1;
+    } else if(symbol_count > 1) {
+        int max_length = 0, min_length = WIDE_MAX_CODE_LENGTH;
+        for(int i = 0; i < symbol_count; ++i) {
+            max_length = MAX(max_length, lengths[i]);
+            min_length = lengths[i] < min_length ? lengths[i] : min_length;
+        }
+        // every code fills all the entries which start with it
+        uint size = 1u << max_length;
+        entries = (wide_entry*) malloc(size * sizeof(wide_entry));
+        if(entries) {
+            wide_codes(lengths, symbol_count, codes);
+            for(int i = 0; i < symbol_count; ++i) {
+                wide_entry entry = { symbols[i], lengths[i] };
+                for(uint k = codes[i].code; k < size; k += 1u << lengths[i]) {
+                    entries[k] = entry;
+                }
+            }
+            success = decode_wide_data(ptr, insize - (ptr - input), output,
+                    *count, entries, max_length, min_length);
+        }
+    }
+    free(symbols);
+    free(lengths);
+    free(codes);
+    free(entries);
+    return success;
 }
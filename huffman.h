@@ -1,10 +1,178 @@
 #ifndef HUFFMAN_H
 #define HUFFMAN_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef unsigned int uint;
 typedef unsigned char uchar;
 
-uchar* huffman_compress(uchar* input, int insize, int* outsize);
+#define HUFFMAN_MIN_CODE_LENGTH 8 // enough for codes of all 256 bytes
+#define HUFFMAN_MAX_CODE_LENGTH 15
+#define HUFFMAN_DEFAULT_CODE_LENGTH 11
+#define HUFFMAN_DEFAULT_BLOCK_SIZE (1 << 20)
+#define HUFFMAN_MAX_BLOCK_SIZE (1 << 26)
+#define HUFFMAN_MAX_CONTEXT_TABLES 8
+
+typedef struct {
+    int max_code_length; // codes are limited to this length, 8..15 bits
+    int block_size; // stream is compressed by independent blocks of this size
+    int threads; // blocks are compressed and decompressed in parallel
+    int interleaved; // code blocks as 4 streams decoded at once, 0 or 1
+    int seekable; // streams end with an index of the blocks, 0 or 1
+    // order-1 coding: the previous byte picks one of at most this many
+    // codes, 2..8, 0 or 1 codes every byte with the same code
+    int context_tables;
+    // batches are coded with one table of all their records, 0 or 1
+    int batch_table;
+} huffman_options;
+
+// receives the output of a stream, returns 1 on success and 0 on failure
+typedef int (*huffman_write_fn)(void* opaque, const uchar* data, size_t size);
+
+// reads at most size bytes and stores their count to read, which is 0
+// at the end of the input; returns 1 on success and 0 on failure
+typedef int (*huffman_read_fn)(void* opaque, uchar* data, size_t size,
+        size_t* read);
+
+// how a block was coded
+#define HUFFMAN_BLOCK_CODED 0
+#define HUFFMAN_BLOCK_STORED 1 // copied as is
+#define HUFFMAN_BLOCK_RLE 2    // runs of bytes
+#define HUFFMAN_BLOCK_CONTEXT 3 // code picked by the previous byte
+
+typedef struct {
+    // nanoseconds spent in every stage of the compression
+    uint64_t histogram_ns; // counting the bytes and their runs
+    uint64_t tree_ns;      // code lengths
+    uint64_t encoder_ns;   // canonical codes
+    uint64_t encode_ns;    // writing the block
+    uint64_t histogram[256];
+    uchar lengths[256];    // of the order-0 code, 0 for missing bytes
+    int mode;              // HUFFMAN_BLOCK_*
+    double entropy;        // bits per byte of the order-0 model
+    double bits_per_symbol; // bits per byte of the payload
+    // size, flags, code lengths, jump table and context map
+    size_t header_bytes;
+    size_t payload_bytes;
+} huffman_stats;
+
+typedef struct huffman_stream huffman_stream;
+typedef struct huffman_codebook huffman_codebook;
+
+void huffman_default_options(huffman_options* options);
+// instruction set of the coding loops picked for this CPU: "avx2", "bmi2"
+// or "generic"
+const char* huffman_kernels(void);
+
+uchar* huffman_compress(uchar* input, size_t insize, size_t* outsize);
+uchar* huffman_compress_ex(uchar* input, size_t insize, size_t* outsize,
+        const huffman_options* options);
 uchar* huffman_decompress(uchar* input);
 
+// largest compressed size of insize bytes
+size_t huffman_compress_bound(size_t insize);
+// allocates nothing with a single thread and without context tables;
+// with threads > 1 inputs of 1 MB or more are counted by a pool made for
+// the call, and context tables take 256 KB of counters for the call
+int huffman_compress_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options);
+// same as huffman_compress_to, stats are filled in on success
+int huffman_compress_stats(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options,
+        huffman_stats* stats);
+// size of the data stored in a compressed block, 0 for a bad header
+size_t huffman_decompressed_size(uchar* input, size_t insize);
+int huffman_decompress_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize);
+
+// many small records compressed in one call into one output: record i
+// takes offsets[i] .. offsets[i + 1] of it, offsets have count + 1
+// entries; the output must have huffman_compress_batch_bound bytes to
+// always fit
+size_t huffman_compress_batch_bound(const size_t* sizes, size_t count);
+int huffman_compress_batch(uchar* const* inputs, const size_t* sizes,
+        size_t count, uchar* output, size_t capacity, size_t* offsets,
+        const huffman_options* options);
+// total size of the records, 0 for a bad header
+size_t huffman_decompressed_size_batch(uchar* input, const size_t* offsets,
+        size_t count);
+int huffman_decompress_batch(uchar* input, const size_t* offsets,
+        size_t count, uchar* output, size_t capacity,
+        size_t* output_offsets);
+
+// 16-bit symbols in blocks of the same format, sizes are counted in
+// symbols; the output of compression must have huffman_compress_bound_wide
+// bytes to always fit
+size_t huffman_compress_bound_wide(size_t count);
+int huffman_compress_wide(const uint16_t* input, size_t count, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options);
+// number of the symbols in a block, 0 for a bad header or a byte block
+size_t huffman_decompressed_size_wide(uchar* input, size_t insize);
+int huffman_decompress_wide(uchar* input, size_t insize, uint16_t* output,
+        size_t capacity, size_t* count);
+
+// code of all the bytes trained on samples and shared by small messages
+huffman_codebook* huffman_train_codebook(const uchar* samples, size_t size,
+        uint id, const huffman_options* options);
+uchar* huffman_save_codebook(const huffman_codebook* codebook,
+        size_t* outsize);
+huffman_codebook* huffman_load_codebook(const uchar* data, size_t size);
+void huffman_destroy_codebook(huffman_codebook* codebook);
+uint huffman_codebook_id(const huffman_codebook* codebook);
+size_t huffman_codebook_bound(const huffman_codebook* codebook,
+        size_t insize);
+int huffman_compress_with(const huffman_codebook* codebook, uchar* input,
+        size_t insize, uchar* output, size_t capacity, size_t* outsize);
+size_t huffman_decompressed_size_with(const huffman_codebook* codebook,
+        uchar* input, size_t insize);
+int huffman_decompress_with(const huffman_codebook* codebook, uchar* input,
+        size_t insize, uchar* output, size_t capacity, size_t* outsize);
+
+huffman_stream* huffman_compress_init(const huffman_options* options,
+        huffman_write_fn write, void* opaque);
+int huffman_compress_feed(huffman_stream* stream, const uchar* data,
+        size_t size);
+int huffman_compress_flush(huffman_stream* stream);
+int huffman_compress_finish(huffman_stream* stream);
+
+huffman_stream* huffman_decompress_init(const huffman_options* options,
+        huffman_write_fn write, void* opaque);
+int huffman_decompress_feed(huffman_stream* stream, const uchar* data,
+        size_t size);
+// writes the data of the blocks read so far without waiting for a batch
+// of them, one per thread
+int huffman_decompress_flush(huffman_stream* stream);
+int huffman_decompress_finish(huffman_stream* stream);
+
+uchar* huffman_compress_parallel(uchar* input, size_t insize,
+        size_t* outsize, const huffman_options* options);
+uchar* huffman_decompress_parallel(uchar* input, size_t insize,
+        size_t* outsize, const huffman_options* options);
+
+// whole buffer into caller buffers, output of compression must have
+// huffman_compress_parallel_bound bytes
+size_t huffman_compress_parallel_bound(size_t insize,
+        const huffman_options* options);
+int huffman_compress_parallel_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options);
+int huffman_decompress_parallel_size(uchar* input, size_t insize,
+        size_t* outsize);
+int huffman_decompress_parallel_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options);
+
+// data size of a seekable stream and decompression of size bytes of its
+// data from offset, only the blocks which cover them are read
+int huffman_seekable_size(uchar* input, size_t insize, size_t* outsize);
+int huffman_decompress_range(uchar* input, size_t insize, size_t offset,
+        size_t size, uchar* output, const huffman_options* options);
+
+// stream format through reader, coder and writer threads working at once
+int huffman_compress_pipe(const huffman_options* options,
+        huffman_read_fn read, void* input, huffman_write_fn write,
+        void* output);
+int huffman_decompress_pipe(const huffman_options* options,
+        huffman_read_fn read, void* input, huffman_write_fn write,
+        void* output);
+
 #endif
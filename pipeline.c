@@ -0,0 +1,347 @@
+#include "huffman.h"
+#include "block_index.h"
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Pipeline keeps the input, the cores and the output busy at once: the
+ * calling thread reads blocks into a ring of slots, coder threads code
+ * them as soon as they are read and a writer thread writes them in the
+ * order they were read. A slot is read again only after it was written,
+ * so the memory is bounded by the ring. The data is in the same stream
+ * format as the one of huffman_compress_init. */
+
+#define SLOTS_PER_THREAD 2 // blocks waiting for a coder or for the writer
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_READ,
+    SLOT_CODED
+} slot_state;
+
+typedef struct {
+    uchar* input;
+    size_t insize;
+    size_t input_capacity;
+    uchar* output;
+    size_t outsize;
+    size_t output_capacity;
+    slot_state state;
+} slot;
+
+typedef struct {
+    huffman_options options; // of a single block
+    char compress;
+    huffman_write_fn write;
+    void* opaque;
+
+    slot* slots;
+    int slot_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // state of any slot or the counters below
+    size_t read;    // blocks read so far
+    size_t next;    // next block to code
+    size_t written; // blocks written so far
+    char done;      // all the blocks are read
+    char failed;
+    block_index index; // of a seekable stream, kept by the writer
+} pipeline;
+
+/* ============= helpers =============== */
+
+// reads until the buffer is full or the input ends
+static int read_full(huffman_read_fn read, void* opaque, uchar* data,
+        size_t size, size_t* total) {
+    size_t count;
+    *total = 0;
+    while(*total < size) {
+        if(!read(opaque, data + *total, size - *total, &count)) {
+            return 0;
+        }
+        if(count == 0) {
+            break;
+        }
+        *total += count;
+    }
+    return 1;
+}
+
+
+static void reserve(uchar** buffer, size_t* capacity, size_t size) {
+    if(size > *capacity) {
+        free(*buffer);
+        *buffer = (uchar*) malloc(size);
+        *capacity = size;
+    }
+}
+
+
+// returns 1 for a block, 0 at the end of the data and -1 on failure
+static int read_slot(pipeline* line, slot* block, huffman_read_fn read,
+        void* opaque) {
+    if(line->compress) {
+        size_t block_size = line->options.block_size;
+        reserve(&block->input, &block->input_capacity, block_size);
+        if(!read_full(read, opaque, block->input, block_size,
+                    &block->insize)) {
+            return -1;
+        }
+        return block->insize > 0;
+    }
+
+    uchar header[BLOCK_HEADER_SIZE];
+    size_t size;
+    if(!read_full(read, opaque, header, BLOCK_HEADER_SIZE, &size) ||
+            size < BLOCK_HEADER_SIZE) {
+        return -1; // the stream ends with the end marker only
+    }
+    block->insize = stream_load_le(header, BLOCK_HEADER_SIZE);
+    if(block->insize == 0) { // only the index follows the end marker
+        size_t index_size = block_index_size(line->read);
+        reserve(&block->input, &block->input_capacity, index_size + 1);
+        if(!read_full(read, opaque, block->input, index_size + 1, &size)) {
+            return -1;
+        }
+        return size == 0 ||
+            block_index_valid(block->input, size, line->read) ? 0 : -1;
+    }
+    if(block->insize > huffman_compress_bound(HUFFMAN_MAX_BLOCK_SIZE)) {
+        return -1;
+    }
+
+    reserve(&block->input, &block->input_capacity, block->insize);
+    if(!read_full(read, opaque, block->input, block->insize, &size) ||
+            size < block->insize) {
+        return -1;
+    }
+    return 1;
+}
+
+
+static int code_slot(pipeline* line, slot* block) {
+    if(line->compress) {
+        return huffman_compress_to(block->input, block->insize,
+                block->output, block->output_capacity, &block->outsize,
+                &line->options);
+    }
+
+    size_t size = huffman_decompressed_size(block->input, block->insize);
+    if(size == 0 || size > HUFFMAN_MAX_BLOCK_SIZE) {
+        return 0;
+    }
+    reserve(&block->output, &block->output_capacity, size);
+    return huffman_decompress_to(block->input, block->insize, block->output,
+            block->output_capacity, &block->outsize);
+}
+
+
+static int write_slot(pipeline* line, slot* block) {
+    if(line->compress) {
+        uchar header[BLOCK_HEADER_SIZE];
+        stream_store_le(header, block->outsize, BLOCK_HEADER_SIZE);
+        if(!line->write(line->opaque, header, BLOCK_HEADER_SIZE)) {
+            return 0;
+        }
+        if(line->options.seekable) {
+            block_index_add(&line->index, block->insize, block->outsize);
+        }
+    }
+    return line->write(line->opaque, block->output, block->outsize);
+}
+
+
+static void* coder(void* arg) {
+    pipeline* line = (pipeline*) arg;
+
+    pthread_mutex_lock(&line->lock);
+    for(;;) {
+        while(!line->failed && line->next == line->read && !line->done) {
+            pthread_cond_wait(&line->changed, &line->lock);
+        }
+        if(line->failed || line->next == line->read) { // nothing left
+            break;
+        }
+        slot* block = line->slots + line->next++ % line->slot_count;
+        pthread_mutex_unlock(&line->lock);
+
+        int success = code_slot(line, block);
+
+        pthread_mutex_lock(&line->lock);
+        block->state = SLOT_CODED;
+        line->failed = line->failed || !success;
+        pthread_cond_broadcast(&line->changed);
+    }
+    pthread_mutex_unlock(&line->lock);
+    return NULL;
+}
+
+
+static void* writer(void* arg) {
+    pipeline* line = (pipeline*) arg;
+
+    pthread_mutex_lock(&line->lock);
+    for(;;) {
+        slot* block = line->slots + line->written % line->slot_count;
+        while(!line->failed && !(line->written < line->read &&
+                    block->state == SLOT_CODED) &&
+                !(line->done && line->written == line->read)) {
+            pthread_cond_wait(&line->changed, &line->lock);
+        }
+        if(line->failed || line->written == line->read) { // all written
+            break;
+        }
+        pthread_mutex_unlock(&line->lock);
+
+        int success = write_slot(line, block);
+
+        pthread_mutex_lock(&line->lock);
+        block->state = SLOT_FREE;
+        line->written++;
+        line->failed = line->failed || !success;
+        pthread_cond_broadcast(&line->changed);
+    }
+    pthread_mutex_unlock(&line->lock);
+    return NULL;
+}
+
+
+static int run_pipeline(pipeline* line, huffman_read_fn read, void* opaque,
+        int threads) {
+    pthread_t* workers = (pthread_t*) malloc((threads + 1) *
+            sizeof(pthread_t));
+    int started = 0;
+    pthread_mutex_init(&line->lock, NULL);
+    pthread_cond_init(&line->changed, NULL);
+
+    // coders and the writer, the calling thread is the reader
+    for(; started <= threads; ++started) {
+        if(pthread_create(workers + started, NULL,
+                    started < threads ? coder : writer, line) != 0) {
+            pthread_mutex_lock(&line->lock);
+            line->failed = 1;
+            pthread_mutex_unlock(&line->lock);
+            break;
+        }
+    }
+
+    for(;;) {
+        pthread_mutex_lock(&line->lock);
+        slot* block = line->slots + line->read % line->slot_count;
+        while(!line->failed && block->state != SLOT_FREE) {
+            pthread_cond_wait(&line->changed, &line->lock);
+        }
+        char failed = line->failed;
+        pthread_mutex_unlock(&line->lock);
+        if(failed) {
+            break;
+        }
+
+        // the slot isn't used by others until it's marked as read
+        int result = read_slot(line, block, read, opaque);
+
+        pthread_mutex_lock(&line->lock);
+        if(result > 0) {
+            block->state = SLOT_READ;
+            line->read++;
+        }
+        line->failed = line->failed || result < 0;
+        pthread_cond_broadcast(&line->changed);
+        pthread_mutex_unlock(&line->lock);
+        if(result <= 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&line->lock);
+    line->done = 1;
+    pthread_cond_broadcast(&line->changed);
+    pthread_mutex_unlock(&line->lock);
+
+    // a thread which didn't start fails the whole pipeline
+    for(int i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_cond_destroy(&line->changed);
+    pthread_mutex_destroy(&line->lock);
+    return !line->failed;
+}
+
+
+static int start_pipeline(const huffman_options* options, char compress,
+        huffman_read_fn read, void* input, huffman_write_fn write,
+        void* output) {
+    pipeline line;
+    memset(&line, 0, sizeof(line));
+    line.options = *options;
+    line.options.threads = 1; // blocks are already parallel
+    line.compress = compress;
+    line.write = write;
+    line.opaque = output;
+
+    line.slot_count = SLOTS_PER_THREAD * options->threads + 1;
+    line.slots = (slot*) calloc(line.slot_count, sizeof(slot));
+    if(compress) {
+        for(int i = 0; i < line.slot_count; ++i) {
+            line.slots[i].output_capacity =
+                huffman_compress_bound(options->block_size);
+            line.slots[i].output = (uchar*)
+                malloc(line.slots[i].output_capacity);
+        }
+    }
+
+    int success = run_pipeline(&line, read, input, options->threads);
+    if(success && compress) { // end of the stream
+        uchar end[BLOCK_HEADER_SIZE] = { 0 };
+        success = write(output, end, BLOCK_HEADER_SIZE) &&
+            (!options->seekable ||
+             block_index_write(&line.index, write, output));
+    }
+    block_index_free(&line.index);
+
+    for(int i = 0; i < line.slot_count; ++i) {
+        free(line.slots[i].input);
+        free(line.slots[i].output);
+    }
+    free(line.slots);
+    return success;
+}
+
+/* =========== public ============ */
+
+int huffman_compress_pipe(const huffman_options* options,
+        huffman_read_fn read, void* input, huffman_write_fn write,
+        void* output) {
+    huffman_options defaults;
+    if(!read || !write) {
+        return 0;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!stream_valid_options(options)) {
+        return 0;
+    }
+    return start_pipeline(options, 1, read, input, write, output);
+}
+
+
+int huffman_decompress_pipe(const huffman_options* options,
+        huffman_read_fn read, void* input, huffman_write_fn write,
+        void* output) {
+    huffman_options defaults;
+    if(!read || !write) {
+        return 0;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(options->threads <= 0) {
+        return 0;
+    }
+    return start_pipeline(options, 0, read, input, write, output);
+}
@@ -0,0 +1,133 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+struct worker_pool {
+    pthread_t* threads;
+    int thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+
+    pool_job job;
+    void* context;
+    int count;       // jobs of the current batch
+    int next;        // next job to take
+    int done;        // finished jobs
+    int generation;  // incremented for every batch
+    char stopping;
+};
+
+/* ============= helpers =============== */
+
+// takes jobs of the current batch until there are none left
+static void run_jobs(worker_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->next < pool->count) {
+        int index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(pool->context, index);
+
+        pthread_mutex_lock(&pool->lock);
+        if(++pool->done == pool->count) {
+            pthread_cond_broadcast(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+static void* worker(void* arg) {
+    worker_pool* pool = (worker_pool*) arg;
+    int generation = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->generation == generation && !pool->stopping) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        generation = pool->generation;
+        char stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(stopping) {
+            return NULL;
+        }
+        run_jobs(pool);
+    }
+}
+
+/* =========== public functions ============ */
+
+worker_pool* pool_create(int threads) {
+    if(threads <= 1) {
+        return NULL; // the calling thread is enough
+    }
+
+    worker_pool* pool = (worker_pool*) calloc(1, sizeof(worker_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    // the calling thread works too
+    pool->threads = (pthread_t*) malloc((threads - 1) * sizeof(pthread_t));
+    for(int i = 0; i < threads - 1; ++i) {
+        if(pthread_create(&pool->threads[i], NULL, worker, pool) != 0) {
+            break;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+
+void pool_destroy(worker_pool* pool) {
+    if(!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->thread_count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+
+void pool_run(worker_pool* pool, pool_job job, void* context, int count) {
+    if(!pool || count == 1) {
+        for(int i = 0; i < count; ++i) {
+            job(context, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->context = context;
+    pool->count = count;
+    pool->next = 0;
+    pool->done = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_jobs(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->done < pool->count) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
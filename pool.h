@@ -0,0 +1,17 @@
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct worker_pool worker_pool;
+
+// job is called once for every index from 0 to count - 1
+typedef void (*pool_job)(void* context, int index);
+
+worker_pool* pool_create(int threads);
+
+void pool_destroy(worker_pool* pool);
+
+// runs the jobs on the pool threads and the calling one, returns when
+// all of them are done; without a pool the jobs run on the calling thread
+void pool_run(worker_pool* pool, pool_job job, void* context, int count);
+
+#endif
@@ -0,0 +1,760 @@
+#include "huffman.h"
+#include "pool.h"
+#include "block_index.h"
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+/* Stream is a sequence of blocks, every block is the 4-byte (little
+ * endian) size of compressed data followed by the data compressed
+ * by huffman_compress_to. Zero size marks the end of the stream.
+ * Blocks are independent, so a batch of them is compressed or
+ * decompressed in parallel when there are several threads. A seekable
+ * stream has an index of the blocks after the end marker. */
+
+#define MAX_COMPRESSED_BLOCK_SIZE huffman_compress_bound(HUFFMAN_MAX_BLOCK_SIZE)
+
+typedef struct {
+    uchar* input;
+    size_t insize;
+    uchar* output; // owned by the caller of the batch
+    size_t capacity;
+    size_t outsize;
+    char success;
+} block_job;
+
+typedef struct {
+    block_job* blocks;
+    const huffman_options* options;
+} batch;
+
+struct huffman_stream {
+    huffman_options options;
+    huffman_write_fn write;
+    void* opaque;
+    worker_pool* pool;
+
+    uchar* buffer; // data of the blocks of the current batch
+    size_t size;
+    size_t capacity;
+
+    block_job* blocks; // one per thread, with its own output buffer
+    int block_count;
+
+    uchar header[BLOCK_HEADER_SIZE]; // size of the block being read
+    int header_size;
+    size_t block_size;
+    size_t blocks_read;
+    block_index index; // of the blocks written to a seekable stream
+    char finished;
+};
+
+/* ============= helpers =============== */
+
+void stream_store_le(uchar* ptr, uint64_t value, int size) {
+    for(int i = 0; i < size; ++i) {
+        ptr[i] = (uchar) (value >> (8 * i));
+    }
+}
+
+
+uint64_t stream_load_le(const uchar* ptr, int size) {
+    uint64_t value = 0;
+    for(int i = size - 1; i >= 0; --i) {
+        value = (value << 8) | ptr[i];
+    }
+    return value;
+}
+
+
+// same limits as those of huffman_compress_to for every block
+int stream_valid_options(const huffman_options* options) {
+    return options->block_size > 0 &&
+        options->block_size <= HUFFMAN_MAX_BLOCK_SIZE &&
+        options->max_code_length >= HUFFMAN_MIN_CODE_LENGTH &&
+        options->max_code_length <= HUFFMAN_MAX_CODE_LENGTH &&
+        options->context_tables >= 0 &&
+        options->context_tables <= HUFFMAN_MAX_CONTEXT_TABLES &&
+        options->threads > 0;
+}
+
+
+static void compress_job(void* context, int index) {
+    batch* jobs = (batch*) context;
+    block_job* block = jobs->blocks + index;
+    block->success = huffman_compress_to(block->input, block->insize,
+            block->output, block->capacity, &block->outsize, jobs->options);
+}
+
+
+// output buffer is sized by the header of the block beforehand
+static void decompress_job(void* context, int index) {
+    block_job* block = ((batch*) context)->blocks + index;
+    block->success = huffman_decompress_to(block->input, block->insize,
+            block->output, block->capacity, &block->outsize);
+}
+
+
+// runs the job for all the blocks, returns 1 if every block succeeded
+static int run_batch(worker_pool* pool, pool_job job, block_job* blocks,
+        int count, const huffman_options* options) {
+    batch jobs = { blocks, options };
+    pool_run(pool, job, &jobs, count);
+
+    int success = 1;
+    for(int i = 0; i < count; ++i) {
+        success = success && blocks[i].success;
+    }
+    return success;
+}
+
+
+static huffman_stream* create_stream(const huffman_options* options,
+        huffman_write_fn write, void* opaque, size_t capacity) {
+    huffman_stream* stream = (huffman_stream*) calloc(1, sizeof(*stream));
+    stream->options = *options;
+    stream->write = write;
+    stream->opaque = opaque;
+    stream->pool = pool_create(options->threads);
+    stream->capacity = capacity;
+    stream->buffer = (uchar*) malloc(capacity);
+    stream->blocks = (block_job*) calloc(options->threads, sizeof(block_job));
+    return stream;
+}
+
+
+static void destroy_stream(huffman_stream* stream) {
+    pool_destroy(stream->pool);
+    for(int i = 0; i < stream->options.threads; ++i) {
+        free(stream->blocks[i].output);
+    }
+    free(stream->blocks);
+    free(stream->buffer);
+    block_index_free(&stream->index);
+    free(stream);
+}
+
+
+// compresses the buffered data and writes the blocks in order
+static int write_batch(huffman_stream* stream) {
+    size_t block_size = stream->options.block_size;
+    int count = 0;
+    for(size_t offset = 0; offset < stream->size; offset += block_size) {
+        block_job* block = stream->blocks + count++;
+        block->input = stream->buffer + offset;
+        block->insize = stream->size - offset < block_size ?
+            stream->size - offset : block_size;
+    }
+
+    // blocks are already parallel
+    huffman_options block_options = stream->options;
+    block_options.threads = 1;
+    int success = run_batch(stream->pool, compress_job, stream->blocks,
+            count, &block_options);
+    for(int i = 0; i < count && success; ++i) {
+        uchar header[BLOCK_HEADER_SIZE];
+        stream_store_le(header, stream->blocks[i].outsize, BLOCK_HEADER_SIZE);
+        success = stream->write(stream->opaque, header, BLOCK_HEADER_SIZE) &&
+            stream->write(stream->opaque, stream->blocks[i].output,
+                    stream->blocks[i].outsize);
+        if(stream->options.seekable) {
+            block_index_add(&stream->index, stream->blocks[i].insize,
+                    stream->blocks[i].outsize);
+        }
+    }
+
+    stream->size = 0;
+    return success;
+}
+
+
+// decompresses the queued blocks and writes their data in order,
+// the buffer isn't moved until they are done
+static int end_batch(huffman_stream* stream) {
+    size_t offset = 0;
+    for(int i = 0; i < stream->block_count; ++i) {
+        block_job* block = stream->blocks + i;
+        block->input = stream->buffer + offset;
+        offset += block->insize;
+
+        // buffers only grow, to the size of the largest block
+        size_t size = huffman_decompressed_size(block->input, block->insize);
+        if(size == 0 || size > HUFFMAN_MAX_BLOCK_SIZE) {
+            return 0;
+        }
+        if(size > block->capacity) {
+            free(block->output);
+            block->output = (uchar*) malloc(size);
+            block->capacity = size;
+        }
+    }
+
+    int success = run_batch(stream->pool, decompress_job, stream->blocks,
+            stream->block_count, NULL);
+    for(int i = 0; i < stream->block_count && success; ++i) {
+        success = stream->write(stream->opaque, stream->blocks[i].output,
+                stream->blocks[i].outsize);
+    }
+
+    stream->block_count = 0;
+    stream->size = 0;
+    return success;
+}
+
+
+// the block was read completely, it waits until there's one per thread
+static int end_block(huffman_stream* stream) {
+    stream->block_count++;
+    stream->blocks_read++;
+    stream->header_size = 0;
+    return stream->block_count < stream->options.threads || end_batch(stream);
+}
+
+/* =========== compression ============ */
+
+huffman_stream* huffman_compress_init(const huffman_options* options,
+        huffman_write_fn write, void* opaque) {
+    huffman_options defaults;
+    if(!write) {
+        return NULL;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!stream_valid_options(options)) {
+        return NULL;
+    }
+
+    // a block for every thread
+    huffman_stream* stream = create_stream(options, write, opaque,
+            (size_t) options->block_size * options->threads);
+    size_t capacity = huffman_compress_bound(options->block_size);
+    for(int i = 0; i < options->threads; ++i) {
+        stream->blocks[i].output = (uchar*) malloc(capacity);
+        stream->blocks[i].capacity = capacity;
+    }
+    return stream;
+}
+
+
+int huffman_compress_feed(huffman_stream* stream, const uchar* data,
+        size_t size) {
+    if(!stream || (!data && size)) {
+        return 0;
+    }
+
+    while(size > 0) {
+        size_t chunk = stream->capacity - stream->size;
+        chunk = chunk < size ? chunk : size;
+        memcpy(stream->buffer + stream->size, data, chunk);
+        stream->size += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if(stream->size == stream->capacity && !write_batch(stream)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int huffman_compress_flush(huffman_stream* stream) {
+    if(!stream) {
+        return 0;
+    }
+    return stream->size == 0 || write_batch(stream);
+}
+
+
+int huffman_compress_finish(huffman_stream* stream) {
+    if(!stream) {
+        return 0;
+    }
+
+    uchar end[BLOCK_HEADER_SIZE] = { 0 };
+    int success = huffman_compress_flush(stream) &&
+        stream->write(stream->opaque, end, BLOCK_HEADER_SIZE) &&
+        (!stream->options.seekable ||
+         block_index_write(&stream->index, stream->write, stream->opaque));
+
+    destroy_stream(stream);
+    return success;
+}
+
+/* =========== decompression ============ */
+
+huffman_stream* huffman_decompress_init(const huffman_options* options,
+        huffman_write_fn write, void* opaque) {
+    huffman_options defaults;
+    if(!write) {
+        return NULL;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(options->threads <= 0) {
+        return NULL;
+    }
+    return create_stream(options, write, opaque, 0);
+}
+
+
+int huffman_decompress_feed(huffman_stream* stream, const uchar* data,
+        size_t size) {
+    if(!stream || (!data && size)) {
+        return 0;
+    }
+
+    while(size > 0) {
+        if(stream->finished) { // only the index follows the end
+            if(size > block_index_size(stream->blocks_read) - stream->size) {
+                return 0;
+            }
+            memcpy(stream->buffer + stream->size, data, size);
+            stream->size += size;
+            return 1;
+        }
+
+        if(stream->header_size < BLOCK_HEADER_SIZE) {
+            stream->header[stream->header_size++] = *data++;
+            size--;
+            if(stream->header_size < BLOCK_HEADER_SIZE) {
+                continue;
+            }
+
+            uint block_size = stream_load_le(stream->header,
+                    BLOCK_HEADER_SIZE);
+            if(block_size == 0) {
+                stream->finished = 1;
+                if(stream->block_count && !end_batch(stream)) {
+                    return 0;
+                }
+                size_t index_size = block_index_size(stream->blocks_read);
+                if(index_size > stream->capacity) {
+                    stream->capacity = index_size;
+                    stream->buffer = (uchar*) realloc(stream->buffer,
+                            stream->capacity);
+                }
+                continue;
+            }
+            if(block_size > MAX_COMPRESSED_BLOCK_SIZE) {
+                return 0;
+            }
+            if(stream->size + block_size > stream->capacity) {
+                stream->capacity = stream->size + block_size;
+                stream->buffer = (uchar*) realloc(stream->buffer,
+                        stream->capacity);
+            }
+            stream->block_size = block_size;
+            stream->blocks[stream->block_count].insize = 0;
+            continue;
+        }
+
+        block_job* block = stream->blocks + stream->block_count;
+        size_t chunk = stream->block_size - block->insize;
+        chunk = chunk < size ? chunk : size;
+        memcpy(stream->buffer + stream->size, data, chunk);
+        stream->size += chunk;
+        block->insize += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if(block->insize == stream->block_size && !end_block(stream)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// the blocks waiting for a full batch are written at once, the block
+// being read moves to the start of the buffer
+int huffman_decompress_flush(huffman_stream* stream) {
+    if(!stream) {
+        return 0;
+    }
+    if(stream->block_count == 0) {
+        return 1;
+    }
+
+    size_t complete = 0;
+    for(int i = 0; i < stream->block_count; ++i) {
+        complete += stream->blocks[i].insize;
+    }
+    size_t partial = stream->size - complete;
+    if(!end_batch(stream)) {
+        return 0;
+    }
+    memmove(stream->buffer, stream->buffer + complete, partial);
+    stream->size = partial;
+    stream->blocks[0].insize = partial;
+    return 1;
+}
+
+
+int huffman_decompress_finish(huffman_stream* stream) {
+    if(!stream) {
+        return 0;
+    }
+
+    // complete blocks of a truncated stream are still written
+    int success = (stream->block_count == 0 || end_batch(stream)) &&
+        stream->finished && (stream->size == 0 ||
+                block_index_valid(stream->buffer, stream->size,
+                    stream->blocks_read));
+    destroy_stream(stream);
+    return success;
+}
+
+/* =========== whole buffer ============ */
+
+static size_t block_count(size_t insize, const huffman_options* options) {
+    return (insize - 1) / options->block_size + 1;
+}
+
+
+size_t huffman_compress_parallel_bound(size_t insize,
+        const huffman_options* options) {
+    huffman_options defaults;
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!stream_valid_options(options) || insize == 0) {
+        return BLOCK_HEADER_SIZE;
+    }
+    // every block is compressed into its own slot of the output
+    size_t count = block_count(insize, options);
+    return count * (BLOCK_HEADER_SIZE +
+            huffman_compress_bound(options->block_size)) + BLOCK_HEADER_SIZE +
+        (options->seekable ? block_index_size(count) : 0);
+}
+
+
+int huffman_compress_parallel_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options) {
+    huffman_options defaults;
+    if(!input || !output || !outsize || insize == 0) {
+        return 0;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(!stream_valid_options(options) ||
+            capacity < huffman_compress_parallel_bound(insize, options)) {
+        return 0;
+    }
+    if(block_count(insize, options) > INT_MAX) { // blocks are indexed by int
+        return 0;
+    }
+
+    // every block is compressed into its own slot of the output,
+    // then the slots are moved together
+    size_t block_size = options->block_size;
+    int count = (int) block_count(insize, options);
+    size_t slot = BLOCK_HEADER_SIZE + huffman_compress_bound(block_size);
+    block_job* blocks = (block_job*) calloc(count, sizeof(block_job));
+    for(int i = 0; i < count; ++i) {
+        size_t offset = i * block_size;
+        blocks[i].input = input + offset;
+        blocks[i].insize = insize - offset < block_size ?
+            insize - offset : block_size;
+        blocks[i].output = output + i * slot + BLOCK_HEADER_SIZE;
+        blocks[i].capacity = slot - BLOCK_HEADER_SIZE;
+    }
+
+    huffman_options block_options = *options;
+    block_options.threads = 1; // blocks are already parallel
+
+    worker_pool* pool = pool_create(options->threads);
+    int success = run_batch(pool, compress_job, blocks, count, &block_options);
+    pool_destroy(pool);
+
+    if(success) {
+        uchar* ptr = output;
+        for(int i = 0; i < count; ++i) {
+            stream_store_le(ptr, blocks[i].outsize, BLOCK_HEADER_SIZE);
+            memmove(ptr + BLOCK_HEADER_SIZE, blocks[i].output,
+                    blocks[i].outsize);
+            ptr += BLOCK_HEADER_SIZE + blocks[i].outsize;
+        }
+        stream_store_le(ptr, 0, BLOCK_HEADER_SIZE);
+        ptr += BLOCK_HEADER_SIZE;
+        if(options->seekable) {
+            block_index index = { NULL, 0, 0 };
+            for(int i = 0; i < count; ++i) {
+                block_index_add(&index, blocks[i].insize, blocks[i].outsize);
+            }
+            block_index_store(&index, ptr);
+            ptr += block_index_size(count);
+            block_index_free(&index);
+        }
+        *outsize = ptr - output;
+    }
+
+    free(blocks);
+    return success;
+}
+
+
+uchar* huffman_compress_parallel(uchar* input, size_t insize,
+        size_t* outsize, const huffman_options* options) {
+    if(!input || !outsize || insize == 0) {
+        return NULL;
+    }
+
+    size_t capacity = huffman_compress_parallel_bound(insize, options);
+    uchar* output = (uchar*) malloc(capacity);
+    if(!huffman_compress_parallel_to(input, insize, output, capacity,
+                outsize, options)) {
+        free(output);
+        return NULL;
+    }
+    return (uchar*) realloc(output, *outsize);
+}
+
+
+// finds the blocks of the stream and the size of their data, the
+// capacity of every block is the size of its data
+static block_job* find_blocks(uchar* input, size_t insize, int* count,
+        size_t* outsize) {
+    int capacity = 16;
+    size_t offset = 0;
+    block_job* blocks = (block_job*) malloc(capacity * sizeof(block_job));
+    *count = 0;
+    *outsize = 0;
+    for(;;) {
+        if(insize - offset < BLOCK_HEADER_SIZE) {
+            free(blocks);
+            return NULL;
+        }
+        uint block_size = stream_load_le(input + offset, BLOCK_HEADER_SIZE);
+        offset += BLOCK_HEADER_SIZE;
+        if(block_size == 0) { // only the index follows the end
+            if(offset < insize && !block_index_valid(input + offset,
+                        insize - offset, *count)) {
+                free(blocks);
+                return NULL;
+            }
+            break;
+        }
+        if(block_size > insize - offset) {
+            free(blocks);
+            return NULL;
+        }
+        if(*count == capacity) {
+            capacity *= 2;
+            blocks = (block_job*) realloc(blocks,
+                    capacity * sizeof(block_job));
+        }
+
+        block_job* block = blocks + (*count)++;
+        block->input = input + offset;
+        block->insize = block_size;
+        block->capacity = huffman_decompressed_size(block->input, block_size);
+        if(block->capacity == 0 || block->capacity > HUFFMAN_MAX_BLOCK_SIZE ||
+                block->capacity > SIZE_MAX - *outsize) {
+            free(blocks);
+            return NULL;
+        }
+        *outsize += block->capacity;
+        offset += block_size;
+    }
+    return blocks;
+}
+
+
+int huffman_decompress_parallel_size(uchar* input, size_t insize,
+        size_t* outsize) {
+    int count;
+    if(!input || !outsize) {
+        return 0;
+    }
+    block_job* blocks = find_blocks(input, insize, &count, outsize);
+    free(blocks);
+    return blocks != NULL;
+}
+
+
+// decodes the blocks into their places of the output
+static int decompress_blocks(block_job* blocks, int count, uchar* output,
+        const huffman_options* options) {
+    uchar* ptr = output;
+    for(int i = 0; i < count; ++i) {
+        blocks[i].output = ptr;
+        ptr += blocks[i].capacity;
+    }
+
+    worker_pool* pool = pool_create(options->threads);
+    int success = run_batch(pool, decompress_job, blocks, count, NULL);
+    pool_destroy(pool);
+    return success;
+}
+
+
+int huffman_decompress_parallel_to(uchar* input, size_t insize, uchar* output,
+        size_t capacity, size_t* outsize, const huffman_options* options) {
+    huffman_options defaults;
+    int count;
+    if(!input || !output || !outsize) {
+        return 0;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(options->threads <= 0) {
+        return 0;
+    }
+
+    block_job* blocks = find_blocks(input, insize, &count, outsize);
+    int success = blocks && *outsize <= capacity &&
+        decompress_blocks(blocks, count, output, options);
+    free(blocks);
+    return success;
+}
+
+
+uchar* huffman_decompress_parallel(uchar* input, size_t insize,
+        size_t* outsize, const huffman_options* options) {
+    huffman_options defaults;
+    int count;
+    if(!input || !outsize) {
+        return NULL;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(options->threads <= 0) {
+        return NULL;
+    }
+
+    block_job* blocks = find_blocks(input, insize, &count, outsize);
+    if(!blocks) {
+        return NULL;
+    }
+    uchar* output = (uchar*) malloc(*outsize ? *outsize : 1);
+    if(!decompress_blocks(blocks, count, output, options)) {
+        free(output);
+        output = NULL;
+    }
+    free(blocks);
+    return output;
+}
+
+/* =========== random access ============ */
+
+int huffman_seekable_size(uchar* input, size_t insize, size_t* outsize) {
+    size_t count;
+    if(!input || !outsize || !block_index_find(input, insize, &count)) {
+        return 0;
+    }
+
+    const uchar* entries = input + insize - block_index_size(count);
+    *outsize = 0;
+    for(size_t i = 0; i < count; ++i) {
+        size_t size = stream_load_le(entries + BLOCK_INDEX_ENTRY_SIZE * i,
+                4);
+        if(size > HUFFMAN_MAX_BLOCK_SIZE || size > SIZE_MAX - *outsize) {
+            return 0;
+        }
+        *outsize += size;
+    }
+    return 1;
+}
+
+
+int huffman_decompress_range(uchar* input, size_t insize, size_t offset,
+        size_t size, uchar* output, const huffman_options* options) {
+    huffman_options defaults;
+    size_t count;
+    if(!input || (!output && size) || size > SIZE_MAX - offset) {
+        return 0;
+    }
+    if(!options) {
+        huffman_default_options(&defaults);
+        options = &defaults;
+    }
+    if(options->threads <= 0 || !block_index_find(input, insize, &count)) {
+        return 0;
+    }
+
+    // blocks end before the end marker and the index
+    const uchar* entries = input + insize - block_index_size(count);
+    size_t blocks_size = entries - input;
+    if(blocks_size < BLOCK_HEADER_SIZE) {
+        return 0;
+    }
+    blocks_size -= BLOCK_HEADER_SIZE;
+
+    // the blocks which cover the range and their offsets are found by
+    // the index alone, those which are covered partially are decoded
+    // aside; only the headers of the covered blocks are read, so the
+    // pages of the blocks before them are never touched
+    size_t end = offset + size, position = 0, compressed = 0;
+    int covered = 0, capacity = 0, success = 1;
+    block_job* blocks = NULL;
+    size_t* starts = NULL; // of the data of the covered blocks
+    for(size_t i = 0; i < count && position < end && success; ++i) {
+        const uchar* entry = entries + BLOCK_INDEX_ENTRY_SIZE * i;
+        size_t data = stream_load_le(entry, 4);
+        size_t packed = stream_load_le(entry + 4, 4);
+        success = data > 0 && data <= HUFFMAN_MAX_BLOCK_SIZE &&
+            blocks_size - compressed >= BLOCK_HEADER_SIZE &&
+            packed <= blocks_size - compressed - BLOCK_HEADER_SIZE;
+        if(success && position + data > offset) {
+            success = stream_load_le(input + compressed,
+                        BLOCK_HEADER_SIZE) == packed &&
+                covered < INT_MAX;
+        }
+        if(success && position + data > offset) {
+            if(covered == capacity) {
+                capacity = capacity ? 2 * capacity : 4;
+                blocks = (block_job*) realloc(blocks,
+                        capacity * sizeof(block_job));
+                starts = (size_t*) realloc(starts,
+                        capacity * sizeof(size_t));
+            }
+            block_job* block = blocks + covered;
+            starts[covered++] = position;
+            block->input = input + compressed + BLOCK_HEADER_SIZE;
+            block->insize = packed;
+            block->capacity = data;
+            block->output = position >= offset && position + data <= end ?
+                output + (position - offset) : (uchar*) malloc(data);
+        }
+        position += data;
+        compressed += BLOCK_HEADER_SIZE + packed;
+    }
+    success = success && position >= end;
+
+    if(success && covered) {
+        worker_pool* pool = pool_create(options->threads);
+        success = run_batch(pool, decompress_job, blocks, covered, NULL);
+        pool_destroy(pool);
+    }
+    for(int i = 0; i < covered; ++i) {
+        success = success && blocks[i].outsize == blocks[i].capacity;
+        if(starts[i] >= offset && starts[i] + blocks[i].capacity <= end) {
+            continue; // decoded in place
+        }
+        if(success) {
+            size_t from = offset > starts[i] ? offset - starts[i] : 0;
+            size_t to = end - starts[i] < blocks[i].capacity ?
+                end - starts[i] : blocks[i].capacity;
+            memcpy(output + (starts[i] + from - offset),
+                    blocks[i].output + from, to - from);
+        }
+        free(blocks[i].output);
+    }
+    free(blocks);
+    free(starts);
+    return success;
+}
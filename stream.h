@@ -0,0 +1,18 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "huffman.h"
+
+/* Helpers of the stream format shared by the stream, the pipeline and
+ * the index of a seekable stream, so their containers stay the same. */
+
+#define BLOCK_HEADER_SIZE 4 // compressed size of the block, little endian
+
+// little endian numbers of size bytes, at most 8
+void stream_store_le(uchar* ptr, uint64_t value, int size);
+uint64_t stream_load_le(const uchar* ptr, int size);
+
+// whether the options are valid for compressing a stream of blocks
+int stream_valid_options(const huffman_options* options);
+
+#endif
@@ -143,6 +143,86 @@ START_TEST(test_data_destroyer_call) {
     ck_assert_int_eq(call_count, 5);
 } END_TEST
 
+int int_cmp(const void* a, const void* b) {
+    return *((int*) a) - *((int*) b);
+}
+
+#define int_less(a, b) ((a) < (b))
+HEAP_DEFINE(int_heap, int, HEAP_DEFAULT_ARITY, int_less)
+
+
+START_TEST(test_value_heap_order) {
+    int data[100], value, previous;
+
+    for(int arity = 2; arity <= 5; ++arity) {
+        value_heap* heap = value_heap_create(100, sizeof(int), arity,
+                &int_cmp);
+        ck_assert_ptr_eq(value_heap_top(heap), NULL);
+        for(int i = 0; i < 100; ++i) {
+            data[i] = rand() % 50;
+            ck_assert_int_eq(value_heap_insert(heap, &data[i]), 1);
+        }
+        ck_assert_int_eq(value_heap_insert(heap, &value), 0);
+
+        value_heap_pop(heap, &previous);
+        for(int i = 1; i < 100; ++i) {
+            ck_assert_int_eq(value_heap_pop(heap, &value), 1);
+            ck_assert_int_le(previous, value);
+            previous = value;
+        }
+        ck_assert_int_eq(value_heap_pop(heap, &value), 0);
+        value_heap_destroy(heap);
+    }
+} END_TEST
+
+
+START_TEST(test_value_heap_build) {
+    int data[37], value, top, count = 0;
+    for(int i = 0; i < 37; ++i)
+        data[i] = (i * 17) % 37;
+
+    value_heap* heap = value_heap_create(37, sizeof(int), HEAP_DEFAULT_ARITY,
+            &int_cmp);
+    ck_assert_int_eq(value_heap_build(heap, data, 37), 1);
+    ck_assert_int_eq(*(const int*) value_heap_top(heap), 0);
+
+    // the top is replaced by a bigger value with a single sift
+    value = 100;
+    ck_assert_int_eq(value_heap_replace_top(heap, &value, &top), 1);
+    ck_assert_int_eq(top, 0);
+    ck_assert_int_eq(*(const int*) value_heap_top(heap), 1);
+    while(value_heap_pop(heap, &value))
+        ck_assert_int_eq(value, ++count < 37 ? count : 100);
+    ck_assert_int_eq(count, 37);
+
+    ck_assert_int_eq(value_heap_build(heap, data, 38), 0);
+    value_heap_destroy(heap);
+} END_TEST
+
+
+START_TEST(test_typed_heap) {
+    int items[64], previous;
+    int_heap heap;
+
+    int_heap_init(&heap, items, 64);
+    for(int i = 0; i < 64; ++i)
+        items[i] = rand() % 1000;
+    int_heap_build(&heap, 64);
+    ck_assert_int_eq(int_heap_push(&heap, 1), 0);
+
+    previous = int_heap_replace_top(&heap, 1000);
+    for(int i = 1; i < 64; ++i) {
+        int value = int_heap_pop(&heap);
+        ck_assert_int_le(previous, value);
+        previous = value;
+    }
+    ck_assert_int_eq(int_heap_pop(&heap), 1000);
+
+    ck_assert_int_eq(int_heap_push(&heap, 5), 1);
+    ck_assert_int_eq(int_heap_push(&heap, 3), 1);
+    ck_assert_int_eq(int_heap_top(&heap), 3);
+} END_TEST
+
 int main(void)
 {
     Suite *s = suite_create("heap");
@@ -161,6 +241,9 @@ int main(void)
     tcase_add_test(tc, test_insert_failure);
     tcase_add_test(tc, test_heap_order);
     tcase_add_test(tc, test_data_destroyer_call);
+    tcase_add_test(tc, test_value_heap_order);
+    tcase_add_test(tc, test_value_heap_build);
+    tcase_add_test(tc, test_typed_heap);
     
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
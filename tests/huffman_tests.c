@@ -1,5 +1,6 @@
 #include <check.h>
 #include "../heap.c"
+#include "../pool.c"
 #include "../huffman.c"
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,24 +27,54 @@ int frequency(char chr) {
 
 START_TEST(test_frequencies) {
     uchar* input = "abbabbabbacccddef";
-    int sym_count;
-    symbol_frequency* freqs = calculate_frequencies(input,
-            strlen(input), &sym_count);
+    uint64_t counts[256];
+    symbol_frequency freqs[256];
+    count_symbols(input, strlen(input), counts);
+    int sym_count = sort_frequencies(counts, freqs);
 
     for(int i = 0; i < sym_count; ++i) {
         ck_assert_int_eq(freqs[i].frequency, frequency(freqs[i].symbol));
     }
 } END_TEST
 
+// interleaved and parallel histograms give the plain counts
+START_TEST(test_count_symbols) {
+    int size = 3 * PARALLEL_COUNT_MIN_SIZE + 13;
+    uchar* input = (uchar*) malloc(size);
+    uint64_t expected[256] = { 0 }, counts[256];
+    for(int i = 0; i < size; ++i) {
+        input[i] = i % 1000 < 500 ? 'a' : rand() % 256;
+        expected[input[i]]++;
+    }
+
+    count_symbols(input, size, counts);
+    ck_assert_msg(memcmp(counts, expected, sizeof(counts)) == 0,
+            "symbols are counted incorrectly");
+
+    count_symbols(input + 3, 21, counts);
+    int total = 0;
+    for(int i = 0; i < 256; ++i)
+        total += counts[i];
+    ck_assert_int_eq(total, 21);
+
+    worker_pool* pool = pool_create(3);
+    count_symbols_parallel(input, size, counts, pool, 3);
+    pool_destroy(pool);
+    ck_assert_msg(memcmp(counts, expected, sizeof(counts)) == 0,
+            "symbols are counted incorrectly by threads");
+    free(input);
+} END_TEST
+
+
 // safety of original data size
 START_TEST(test_original_size) {
     uchar* input = "adasdaskjdasnk;dfjhbaslkerfgbas";
-    int comp_size, decomp_size;
+    size_t comp_size, decomp_size;
     uchar* output = huffman_compress(input, strlen(input), &comp_size);
-    decomp_size = ((int*)output)[0];
+    decomp_size = huffman_decompressed_size(output, comp_size);
 
     ck_assert_msg(strlen(input) == decomp_size,
-            "original data size is stored incorrectly:\ngot %d\nshould be %d",
+            "original data size is stored incorrectly:\ngot %zu\nshould be %zu",
             decomp_size, strlen(input));
     free(output);
 } END_TEST
@@ -51,82 +82,95 @@ START_TEST(test_original_size) {
 
 // correctness of writing the symbol code to bit_stream
 START_TEST(test_code_write) {
-    int offset = 0;
-    long int original_number = (long int) rand() % (1 << 26);
+    int offset = rand() % 64;
+    uint64_t original_number = (uint64_t) rand() % (1 << 26);
 
-    symbol_code* code = (symbol_code*) malloc(sizeof(symbol_code));
-    code->code = (uchar*) calloc(16, 1);
+    symbol_code prefix = { 0, offset };
+    symbol_code code = { original_number, 26 };
     int bufsize = 20;
 
     uchar* buf = (uchar*) calloc(bufsize, 1);
-    bit_stream* stream = (bit_stream*) malloc(sizeof(bit_stream));
-    stream->byte = buf;
-    stream->bit_pos = offset;
+    bit_stream stream = { buf, 0, 0 };
 
-    ((long int*) code->code)[0] = original_number;
+    write_code(&stream, &prefix);
+    write_code(&stream, &code);
+    flush_stream(&stream);
 
-    uchar* ptr = stream->byte;
-    write_code(stream, code);
+    ck_assert_int_eq(stream.byte - buf, (offset + 26 + 7) / 8);
 
-    long int written_number = ((long int*) buf)[0] >> offset;
+    uint64_t written_number = 0;
+    for(int i = 0; i < 26; ++i) {
+        int bit = offset + i;
+        written_number |= (uint64_t) ((buf[bit / 8] >> (bit % 8)) & 1) << i;
+    }
 
     ck_assert_msg(written_number == original_number,
             "symbol code has been written incorrectly");
-    free(code->code);
-    free(stream);
     free(buf);
 } END_TEST
 
 
-int trees_equal(encoder_tree_node* t_enc, decoder_tree_node* t_dec) {
-    int result = 1;
-    if(!t_enc->is_leaf) {
-        result &= trees_equal(t_enc->data.childs.zero, t_dec->data.childs.zero);
-        result &= trees_equal(t_enc->data.childs.one, t_dec->data.childs.one);
-    } else {
-        return result = t_enc->data.symbol == t_dec->data.symbol;
-    }
-    return result;
-}
-
-
-// equivalence of encoder and decoder trees
-START_TEST(test_trees_equal) {
-    int sym_count, outsize = 0, insize;
+// equivalence of code lengths on the encoder and decoder sides
+START_TEST(test_lengths_equal) {
+    int sym_count, insize;
     uchar* input = "aaabbccaszxodchnas;oskdhasifgd";
     insize = strlen(input);
 
-    symbol_frequency* freqs = calculate_frequencies(input, insize, &sym_count);
-    encoder_tree_node* tree = generate_encoder_tree(freqs, sym_count);
-    free(freqs);
+    uint64_t counts[256];
+    symbol_frequency freqs[256];
+    count_symbols(input, insize, counts);
+    sym_count = sort_frequencies(counts, freqs);
+    encoder_tree tree;
+    encoder_tree_node* root = generate_encoder_tree(freqs, sym_count, &tree);
 
-    // bit prefix for recursive tree traverse 
-    symbol_code prefix;
-    prefix.code = (uchar*) malloc(16);
-    prefix.bit_length = 0;
-    memset(prefix.code, 0, 16);
-    free(prefix.code);
+    uchar lengths[256] = { 0 }, read[256];
+    tree_code_lengths(root, lengths, 0);
 
-    uchar* buf = (uchar*) malloc(512);
+    uchar* buf = (uchar*) malloc(lengths_size(lengths));
     uchar* ptr = buf;
-    write_tree(tree, &ptr, &outsize); 
+    write_lengths(lengths, &ptr);
+    ck_assert_int_eq(ptr - buf, lengths_size(lengths));
 
     ptr = buf;
-    int dtree_size;
-    decoder_tree_node* dtree = read_decoder_tree(&ptr, NULL);
-
-    ck_assert_msg(trees_equal(tree, dtree) == 1, "encoder and decoder trees are not equal");
+    ck_assert_int_eq(read_lengths(&ptr, read), sym_count);
+    ck_assert_int_eq(ptr - buf, lengths_size(lengths));
+    ck_assert_msg(memcmp(lengths, read, 256) == 0,
+            "encoder and decoder code lengths are not equal");
 
-    destroy_encoder_tree(tree);
-    destroy_decoder_tree(dtree);
     free(buf);
 } END_TEST
 
 
+// canonical codes must be prefix-free
+START_TEST(test_canonical_codes) {
+    uchar lengths[256] = { 0 };
+    lengths['a'] = 1;
+    lengths['b'] = 3;
+    lengths['c'] = 3;
+    lengths['d'] = 3;
+    lengths['e'] = 4;
+    lengths['f'] = 4;
+
+    symbol_code encoder[256];
+    fill_encoder(lengths, encoder);
+
+    char* symbols = "abcdef";
+    for(int i = 0; i < 6; ++i) {
+        for(int j = 0; j < 6; ++j) {
+            symbol_code x = encoder[symbols[i]], y = encoder[symbols[j]];
+            uint64_t mask = ((uint64_t) 1 << x.bit_length) - 1;
+            ck_assert_msg(i == j || x.bit_length > y.bit_length ||
+                    (y.code & mask) != x.code, "codes are not prefix-free");
+        }
+    }
+} END_TEST
+
+
 // equivalence of original and decompressed data
 START_TEST(test_compress_decompress) {
     uchar* input = "abcdeaaabccsaderasdadzxcvmc";
-    int size = strlen(input), comp_size;
+    int size = strlen(input);
+    size_t comp_size;
     uchar* output = huffman_compress(input, size, &comp_size);
     uchar* decompressed = huffman_decompress(output);
 
@@ -146,7 +190,8 @@ START_TEST(test_compress_decompress) {
 // correctnes of big data compression/decompression
 START_TEST(test_big_data) {
     printf("\nbig sample test\n");
-    int size = 100000, j = 0, power = 3, comp_size, decomp_size;
+    int size = 100000, j = 0, power = 3;
+    size_t comp_size, decomp_size;
     uchar* input = (uchar*) malloc(size);
     srand(time(0));
     int subsize = size/2, subsubsize = size / 4;
@@ -161,10 +206,10 @@ START_TEST(test_big_data) {
     for(; j < size; ++j) 
         input[j] = rand() % 256;
     uchar* output = huffman_compress(input, size, &comp_size);
-    printf("compressed size = %d\n", comp_size);
-    decomp_size = ((int*) output)[0];
+    printf("compressed size = %zu\n", comp_size);
+    decomp_size = huffman_decompressed_size(output, comp_size);
     uchar* decompressed = huffman_decompress(output);
-    printf("decompressed size = %d\n", decomp_size);
+    printf("decompressed size = %zu\n", decomp_size);
 
     int error = 0;
     for(int j = 0; j < size; ++j) {
@@ -188,14 +233,14 @@ START_TEST(test_one_symbol) {
     for(int j = 0; j < size; ++j) 
         input[j] = 12;
 
-    int comp_size, decomp_size;
+    size_t comp_size, decomp_size;
 
     printf("\none symbol case\n");
     uchar* output = huffman_compress(input, size, &comp_size);
-    printf("compressed size = %d\n", comp_size);
-    decomp_size = ((int*) output)[0];
+    printf("compressed size = %zu\n", comp_size);
+    decomp_size = huffman_decompressed_size(output, comp_size);
     uchar* decompressed = huffman_decompress(output);
-    printf("decompressed size = %d\n", decomp_size);
+    printf("decompressed size = %zu\n", decomp_size);
 
     int error = 0;
     for(int j = 0; j < size; ++j) {
@@ -213,10 +258,124 @@ START_TEST(test_one_symbol) {
 } END_TEST
 
 
+// fibonacci frequencies make the deepest possible tree
+static uchar* fibonacci_input(int* size) {
+    int fib[24];
+    fib[0] = fib[1] = 1;
+    for(int i = 2; i < 24; ++i)
+        fib[i] = fib[i - 1] + fib[i - 2];
+    *size = 0;
+    for(int i = 0; i < 24; ++i)
+        *size += fib[i];
+
+    uchar* input = (uchar*) malloc(*size);
+    for(int i = 0, j = 0; i < 24; ++i)
+        for(int k = 0; k < fib[i]; ++k)
+            input[j++] = 'a' + i;
+    for(int i = *size - 1; i > 0; --i) { // no runs, so it's coded
+        int k = rand() % (i + 1);
+        uchar symbol = input[i];
+        input[i] = input[k];
+        input[k] = symbol;
+    }
+    return input;
+}
+
+
+// codes of a deep tree are limited to the configured length
+START_TEST(test_long_codes) {
+    int size;
+    size_t comp_size;
+    uint64_t data_size;
+    uchar* input = fibonacci_input(&size);
+    huffman_options options;
+    huffman_default_options(&options);
+
+    for(int limit = 8; limit <= HUFFMAN_MAX_CODE_LENGTH; ++limit) {
+        options.max_code_length = limit;
+        uchar* output = huffman_compress_ex(input, size, &comp_size, &options);
+
+        // code lengths follow the data size and the flags
+        uchar lengths[256], *ptr = output + 1 +
+            read_block_size(output, comp_size, &data_size);
+        ck_assert_int_eq(ptr[-1], 0);
+        ck_assert_int_eq(read_lengths(&ptr, lengths), 24);
+        for(int i = 0; i < 256; ++i)
+            ck_assert_int_le(lengths[i], limit);
+
+        uchar* decompressed = huffman_decompress(output);
+        ck_assert_msg(memcmp(input, decompressed, size) == 0,
+                "original data recovered incorrectly");
+        free(output);
+        free(decompressed);
+    }
+
+    options.max_code_length = HUFFMAN_MAX_CODE_LENGTH + 1;
+    ck_assert_ptr_eq(huffman_compress_ex(input, size, &comp_size, &options),
+            NULL);
+    free(input);
+} END_TEST
+
+
+// package-merge without an active limit gives the huffman code cost
+START_TEST(test_limit_optimal) {
+    uchar* input = "abbabbabbacccddefghhhhhhhhhhhhhhhiiiijklmnnnn";
+    int insize = strlen(input), sym_count;
+
+    uint64_t counts[256];
+    symbol_frequency freqs[256];
+    count_symbols(input, insize, counts);
+    sym_count = sort_frequencies(counts, freqs);
+    encoder_tree tree;
+    uchar tree_lengths[256] = { 0 }, limited_lengths[256];
+    tree_code_lengths(generate_encoder_tree(freqs, sym_count, &tree),
+            tree_lengths, 0);
+    limit_code_lengths(freqs, sym_count, 15, limited_lengths);
+
+    int tree_cost = 0, limited_cost = 0;
+    for(int i = 0; i < sym_count; ++i) {
+        tree_cost += freqs[i].frequency * tree_lengths[freqs[i].symbol];
+        limited_cost += freqs[i].frequency * limited_lengths[freqs[i].symbol];
+    }
+    ck_assert_int_eq(tree_cost, limited_cost);
+} END_TEST
+
+
+// blocks coded as interleaved streams
+START_TEST(test_interleaved) {
+    int sizes[] = { 100, 1024, 1027, 100001 };
+    size_t comp_size;
+    uint64_t data_size;
+    huffman_options options;
+    huffman_default_options(&options);
+    options.interleaved = 1;
+
+    for(int i = 0; i < 4; ++i) {
+        uchar* input = (uchar*) malloc(sizes[i]);
+        for(int j = 0; j < sizes[i]; ++j)
+            input[j] = (j % 11) * (j % 5) + rand() % 3;
+
+        uchar* output = huffman_compress_ex(input, sizes[i], &comp_size,
+                &options);
+        // small blocks are not split
+        int flags = output[read_block_size(output, comp_size, &data_size)];
+        ck_assert_int_eq(flags, sizes[i] >= 1024 ? BLOCK_INTERLEAVED : 0);
+
+        uchar* decompressed = huffman_decompress(output);
+        ck_assert_msg(memcmp(input, decompressed, sizes[i]) == 0,
+                "original data recovered incorrectly");
+        free(input);
+        free(output);
+        free(decompressed);
+    }
+} END_TEST
+
+
 // NULL data compression test
 START_TEST(test_compress_null) {
     uchar* input = NULL;
-    int size = 100, comp_size;
+    int size = 100;
+    size_t comp_size;
     uchar* output = huffman_compress(input, size, &comp_size);
     ck_assert_int_eq(output, NULL);
 } END_TEST
@@ -225,7 +384,8 @@ START_TEST(test_compress_null) {
 // null data decompression test
 START_TEST(test_decompress_null) {
     uchar* input = "asdhakdha;skdh23048903kopjm54638746";
-    int size = strlen(input), comp_size, decomp_size;
+    int size = strlen(input);
+    size_t comp_size;
     uchar* output = huffman_compress(input, size, &comp_size);
 
     uchar* decompressed = huffman_decompress(NULL);
@@ -238,16 +398,237 @@ START_TEST(test_decompress_null) {
 // zero size compression test
 START_TEST(test_zero_size) {
     uchar* input = "asdhakdha;skdh23048903kopjm54638746";
-    int size = 0, comp_size;
+    int size = 0;
+    size_t comp_size;
     uchar* output = huffman_compress(input, size, &comp_size);
     ck_assert_int_eq(output, NULL);
 } END_TEST
 
 
+// compression into caller buffers never needs more than the bound
+START_TEST(test_compress_bound) {
+    int sizes[] = { 1, 255, 1024, 70001 };
+    size_t comp_size, size;
+    huffman_options options;
+    huffman_default_options(&options);
+
+    for(int i = 0; i < 4; ++i) {
+        uchar* input = (uchar*) malloc(sizes[i]);
+        uchar* restored = (uchar*) malloc(sizes[i]);
+        for(int mode = 0; mode < 4; ++mode) {
+            for(int j = 0; j < sizes[i]; ++j) // random, skewed, one symbol
+                input[j] = mode == 0 ? rand() % 256 :
+                    mode == 1 ? (rand() % 64 ? 'a' : rand() % 256) :
+                    mode == 2 ? j % 256 : 'z';
+            options.interleaved = mode % 2;
+
+            size_t bound = huffman_compress_bound(sizes[i]);
+            uchar* output = (uchar*) malloc(bound);
+            ck_assert_int_eq(huffman_compress_to(input, sizes[i], output,
+                        bound, &comp_size, &options), 1);
+            ck_assert_int_le(comp_size, bound);
+            ck_assert_int_eq(huffman_decompressed_size(output, comp_size),
+                    sizes[i]);
+
+            ck_assert_int_eq(huffman_decompress_to(output, comp_size,
+                        restored, sizes[i], &size), 1);
+            ck_assert_int_eq(size, sizes[i]);
+            ck_assert(memcmp(input, restored, size) == 0);
+
+            // neither side writes past a short buffer
+            ck_assert_int_eq(huffman_compress_to(input, sizes[i], output,
+                        comp_size - 1, &size, &options), 0);
+            ck_assert_int_eq(huffman_decompress_to(output, comp_size,
+                        restored, sizes[i] - 1, &size), 0);
+            free(output);
+        }
+        free(input);
+        free(restored);
+    }
+    ck_assert_int_eq(huffman_decompressed_size((uchar*) "ab", 2), 0);
+} END_TEST
+
+
+// every block takes the cheapest of the stored, run-length and coded modes
+START_TEST(test_block_modes) {
+    int size = 100000;
+    size_t comp_size, restored_size;
+    uint64_t data_size;
+    uchar* input = (uchar*) malloc(size);
+    uchar* restored = (uchar*) malloc(size);
+    int flags[] = { BLOCK_STORED, BLOCK_RLE, 0 };
+
+    for(int mode = 0; mode < 3; ++mode) {
+        for(int j = 0; j < size; ++j) // random, runs, skewed
+            input[j] = mode == 0 ? rand() % 256 :
+                mode == 1 ? (j / 50) % 7 : (rand() % 8 ? 'a' : 'b' + j % 3);
+        uchar* output = huffman_compress(input, size, &comp_size);
+        int header = read_block_size(output, comp_size, &data_size);
+        ck_assert_int_eq(output[header], flags[mode]);
+        ck_assert_int_le(comp_size, huffman_compress_bound(size));
+        if(mode == 0)
+            ck_assert_int_eq(comp_size, header + 1 + size);
+        else
+            ck_assert_int_lt(comp_size, size / 2);
+
+        ck_assert_int_eq(huffman_decompress_to(output, comp_size, restored,
+                    size, &restored_size), 1);
+        ck_assert(memcmp(input, restored, size) == 0);
+        // cut data and broken runs are rejected
+        if(mode < 2)
+            ck_assert_int_eq(huffman_decompress_to(output, comp_size - 1,
+                        restored, size, &restored_size), 0);
+        if(mode == 1) {
+            output[header + 2] = 127; // the first run is too long now
+            output[header + 3] = 0;
+            ck_assert_int_eq(huffman_decompress_to(output, comp_size,
+                        restored, size, &restored_size), 0);
+        }
+        free(output);
+    }
+    ck_assert_int_eq(huffman_compress_bound(size), size + 12);
+    free(input);
+    free(restored);
+} END_TEST
+
+
+// stats describe the block which was written
+START_TEST(test_stats) {
+    int size = 50000;
+    size_t comp_size;
+    uchar* input = (uchar*) malloc(size);
+    uchar* output = (uchar*) malloc(huffman_compress_bound(size));
+    huffman_stats stats;
+    huffman_options options;
+    huffman_default_options(&options);
+
+    for(int mode = 0; mode < 2; ++mode) {
+        options.interleaved = mode;
+        for(int j = 0; j < size; ++j)
+            input[j] = rand() % 4 ? 'a' + rand() % 4 : 'x';
+        ck_assert_int_eq(huffman_compress_stats(input, size, output,
+                    huffman_compress_bound(size), &comp_size, &options,
+                    &stats), 1);
+        ck_assert_int_eq(stats.mode, HUFFMAN_BLOCK_CODED);
+        ck_assert_int_eq(stats.header_bytes + stats.payload_bytes,
+                comp_size);
+        ck_assert_int_eq(stats.histogram['x'] + stats.histogram['a'] +
+                stats.histogram['b'] + stats.histogram['c'] +
+                stats.histogram['d'], size);
+        ck_assert_int_gt(stats.lengths['x'], 0);
+        ck_assert_int_eq(stats.lengths['y'], 0);
+        // huffman code is within a bit of the entropy
+        ck_assert(stats.entropy > 2.0 && stats.entropy < 2.4);
+        ck_assert(stats.bits_per_symbol >= stats.entropy);
+        ck_assert(stats.bits_per_symbol < stats.entropy + 1);
+        ck_assert(stats.histogram_ns + stats.tree_ns + stats.encoder_ns +
+                stats.encode_ns > 0);
+    }
+
+    for(int j = 0; j < size; ++j)
+        input[j] = rand() % 256;
+    ck_assert_int_eq(huffman_compress_stats(input, size, output,
+                huffman_compress_bound(size), &comp_size, NULL, &stats), 1);
+    ck_assert_int_eq(stats.mode, HUFFMAN_BLOCK_STORED);
+    ck_assert_int_eq(stats.payload_bytes, size);
+    free(input);
+    free(output);
+} END_TEST
+
+
+// sizes are stored by 7 bits up to 64-bit ones
+START_TEST(test_varint) {
+    uint64_t values[] = { 0, 1, 127, 128, 300, UINT32_MAX,
+        (uint64_t) UINT32_MAX + 1, UINT64_MAX }, value;
+    int sizes[] = { 1, 1, 1, 2, 2, 5, 5, 10 };
+    uchar buf[MAX_VARINT_SIZE + 1];
+
+    for(int i = 0; i < 8; ++i) {
+        uchar* ptr = buf;
+        write_varint(&ptr, values[i]);
+        ck_assert_int_eq(ptr - buf, sizes[i]);
+        ck_assert_int_eq(read_varint(buf, sizes[i], &value), sizes[i]);
+        ck_assert(value == values[i]);
+        // cut numbers are broken
+        ck_assert_int_eq(read_varint(buf, sizes[i] - 1, &value), 0);
+    }
+
+    // no more than 64 bits
+    memset(buf, 0xff, sizeof(buf));
+    ck_assert_int_eq(read_varint(buf, sizeof(buf), &value), 0);
+    buf[MAX_VARINT_SIZE - 1] = 2;
+    ck_assert_int_eq(read_varint(buf, sizeof(buf), &value), 0);
+
+    // header of a block over 4 GB
+    uchar header[] = { FORMAT_VERSION, 0x80, 0x80, 0x80, 0x80, 0x20 };
+    ck_assert(huffman_decompressed_size(header, 6) ==
+            (size_t) ((uint64_t) 1 << 33));
+    header[0] = FORMAT_VERSION + 1;
+    ck_assert_int_eq(huffman_decompressed_size(header, 6), 0);
+} END_TEST
+
+
+// small messages coded with a shared codebook
+START_TEST(test_codebook) {
+    uchar* samples = "{\"method\": \"get\", \"id\": 1, \"params\": [\"user\"]}"
+        "{\"method\": \"put\", \"id\": 2, \"params\": [\"item\", 3]}";
+    uchar* messages[] = { "{\"method\": \"get\", \"id\": 7}",
+        "\x01\xff\x80 not in the samples", "" };
+    uchar output[256], restored[256];
+    size_t size, saved_size, restored_size;
+
+    huffman_codebook* trained = huffman_train_codebook(samples,
+            strlen(samples), 42, NULL);
+    ck_assert_ptr_ne(trained, NULL);
+    uchar* saved = huffman_save_codebook(trained, &saved_size);
+    huffman_codebook* codebook = huffman_load_codebook(saved, saved_size);
+    ck_assert_ptr_ne(codebook, NULL);
+    ck_assert_int_eq(huffman_codebook_id(codebook), 42);
+    ck_assert(memcmp(trained->lengths, codebook->lengths, 256) == 0);
+
+    for(int i = 0; i < 3; ++i) {
+        size_t insize = strlen(messages[i]);
+        ck_assert_int_eq(huffman_compress_with(trained, messages[i], insize,
+                    output, sizeof(output), &size), 1);
+        ck_assert_int_le(size, huffman_codebook_bound(trained, insize));
+        ck_assert_int_eq(huffman_decompressed_size_with(codebook, output,
+                    size), insize);
+        ck_assert_int_eq(huffman_decompress_with(codebook, output, size,
+                    restored, sizeof(restored), &restored_size), 1);
+        ck_assert_int_eq(restored_size, insize);
+        ck_assert(memcmp(messages[i], restored, insize) == 0);
+    }
+
+    // the message is smaller than the one with its own code lengths
+    size_t insize = strlen(messages[0]), block_size;
+    huffman_compress_with(codebook, messages[0], insize, output,
+            sizeof(output), &size);
+    uchar* block = huffman_compress(messages[0], insize, &block_size);
+    ck_assert_int_lt(size, block_size);
+    ck_assert_int_eq(huffman_compress_with(codebook, messages[0], insize,
+                output, size - 1, &size), 0);
+    free(block);
+
+    // other codebooks and broken ones are rejected
+    huffman_codebook* other = huffman_train_codebook(samples, 10, 43, NULL);
+    ck_assert_int_eq(huffman_decompress_with(other, output, size,
+                restored, sizeof(restored), &restored_size), 0);
+    ck_assert_ptr_eq(huffman_load_codebook(saved, saved_size - 1), NULL);
+    saved[0]++;
+    ck_assert_ptr_eq(huffman_load_codebook(saved, saved_size), NULL);
+
+    free(saved);
+    huffman_destroy_codebook(trained);
+    huffman_destroy_codebook(codebook);
+    huffman_destroy_codebook(other);
+} END_TEST
+
+
 // bad pointer to input size test
 START_TEST(test_bad_insize_pointer) {
     uchar* input = "asdhakdha;skdh23048903kopjm54638746";
-    int size = strlen(input), *comp_size = NULL;
+    int size = strlen(input);
+    size_t* comp_size = NULL;
     uchar* output = huffman_compress(input, size, comp_size);
     ck_assert_int_eq(output, NULL);
 
@@ -255,6 +636,272 @@ START_TEST(test_bad_insize_pointer) {
 } END_TEST
 
 
+// bytes after the first half of the alphabet come from the second one
+// and vice versa, so each half of the contexts needs only 3 bits a byte
+START_TEST(test_context_tables) {
+    int size = 100000;
+    size_t order0_size, comp_size, restored_size;
+    uint64_t data_size;
+    uchar* input = (uchar*) malloc(size);
+    uchar* output = (uchar*) malloc(huffman_compress_bound(size));
+    uchar* restored = (uchar*) malloc(size);
+    huffman_stats stats;
+    huffman_options options;
+    huffman_default_options(&options);
+
+    input[0] = 'a';
+    for(int j = 1; j < size; ++j)
+        input[j] = (input[j - 1] < 'i' ? 'i' : 'a') + rand() % 8;
+    ck_assert_int_eq(huffman_compress_to(input, size, output,
+                huffman_compress_bound(size), &order0_size, &options), 1);
+
+    options.context_tables = 2;
+    ck_assert_int_eq(huffman_compress_stats(input, size, output,
+                huffman_compress_bound(size), &comp_size, &options,
+                &stats), 1);
+    int header = read_block_size(output, comp_size, &data_size);
+    ck_assert_int_eq(output[header], BLOCK_CONTEXT);
+    ck_assert_int_eq(stats.mode, HUFFMAN_BLOCK_CONTEXT);
+    ck_assert_int_eq(output[header + 1], 2);
+    ck_assert_int_lt(comp_size, order0_size * 4 / 5);
+    ck_assert_int_eq(huffman_decompress_to(output, comp_size, restored,
+                size, &restored_size), 1);
+    ck_assert_int_eq(restored_size, size);
+    ck_assert(memcmp(input, restored, size) == 0);
+
+    // cut tables and a wrong table count are rejected
+    ck_assert_int_eq(huffman_decompress_to(output, header + 40, restored,
+                size, &restored_size), 0);
+    output[header + 1] = HUFFMAN_MAX_CONTEXT_TABLES + 1;
+    ck_assert_int_eq(huffman_decompress_to(output, comp_size, restored,
+                size, &restored_size), 0);
+
+    options.context_tables = HUFFMAN_MAX_CONTEXT_TABLES + 1;
+    ck_assert_int_eq(huffman_compress_to(input, size, output,
+                huffman_compress_bound(size), &comp_size, &options), 0);
+    free(input);
+    free(output);
+    free(restored);
+} END_TEST
+
+
+// skewed ids spread over the whole 16-bit range take fewer bits as
+// symbols than as pairs of unrelated bytes
+START_TEST(test_wide) {
+    int count = 100000;
+    size_t comp_size, byte_size, restored_count;
+    uint16_t ids[256];
+    uint16_t* input = (uint16_t*) malloc(count * sizeof(uint16_t));
+    uint16_t* restored = (uint16_t*) malloc(count * sizeof(uint16_t));
+    uchar* output = (uchar*) malloc(huffman_compress_bound_wide(count));
+    for(int j = 0; j < 256; ++j)
+        ids[j] = rand();
+
+    for(int mode = 0; mode < 3; ++mode) {
+        for(int j = 0; j < count; ++j) // ids, random, constant
+            input[j] = mode == 0 ? ids[rand() % (1 + rand() % 256)] :
+                mode == 1 ? rand() : 7;
+        ck_assert_int_eq(huffman_compress_wide(input, count, output,
+                    huffman_compress_bound_wide(count), &comp_size, NULL), 1);
+        ck_assert_int_eq(huffman_decompressed_size_wide(output, comp_size),
+                count);
+        ck_assert_int_eq(huffman_decompress_wide(output, comp_size, restored,
+                    count, &restored_count), 1);
+        ck_assert_int_eq(restored_count, count);
+        ck_assert(memcmp(input, restored, count * sizeof(uint16_t)) == 0);
+        // byte blocks and wide blocks don't mix
+        ck_assert_int_eq(huffman_decompress_to(output, comp_size,
+                    (uchar*) restored, 2 * count, &restored_count), 0);
+
+        if(mode == 0) {
+            uchar* bytes = huffman_compress((uchar*) input, 2 * count,
+                    &byte_size);
+            ck_assert_int_lt(comp_size, byte_size * 2 / 3);
+            ck_assert_int_eq(huffman_decompressed_size_wide(bytes,
+                        byte_size), 0);
+            ck_assert_int_eq(huffman_decompress_wide(bytes, byte_size,
+                        restored, count, &restored_count), 0);
+            free(bytes);
+            // cut header is rejected
+            ck_assert_int_eq(huffman_decompress_wide(output, 10, restored,
+                        count, &restored_count), 0);
+        } else if(mode == 1) {
+            // version, 3 bytes of size, flags and the symbols as is
+            ck_assert_int_eq(comp_size, 5 + 2 * count);
+        } else {
+            ck_assert_int_lt(comp_size, 10);
+        }
+    }
+    free(input);
+    free(restored);
+    free(output);
+} END_TEST
+
+
+// every cut of a coded block fails, the decoders stop at the end of
+// the input they are given
+START_TEST(test_truncated) {
+    int size = 5000;
+    size_t comp_size, restored_size;
+    uchar* input = (uchar*) malloc(size);
+    uchar* output = (uchar*) malloc(huffman_compress_bound(size));
+    uchar* restored = (uchar*) malloc(size);
+    huffman_options options;
+    huffman_default_options(&options);
+
+    input[0] = 'a';
+    for(int j = 1; j < size; ++j)
+        input[j] = (input[j - 1] < 'i' ? 'i' : 'a') + rand() % 8;
+    for(int mode = 0; mode < 3; ++mode) { // single, interleaved, context
+        options.interleaved = mode == 1;
+        options.context_tables = mode == 2 ? 2 : 0;
+        ck_assert_int_eq(huffman_compress_to(input, size, output,
+                    huffman_compress_bound(size), &comp_size, &options), 1);
+        for(size_t cut = 0; cut < comp_size; ++cut) {
+            uchar* data = (uchar*) malloc(cut + 1);
+            memcpy(data, output, cut);
+            ck_assert_int_eq(huffman_decompress_to(data, cut, restored,
+                        size, &restored_size), 0);
+            free(data);
+        }
+        ck_assert_int_eq(huffman_decompress_to(output, comp_size, restored,
+                    size, &restored_size), 1);
+        ck_assert(memcmp(input, restored, size) == 0);
+    }
+    free(input);
+    free(output);
+    free(restored);
+} END_TEST
+
+
+// records of a batch come back at the output offsets, with one table
+// they take less and their blocks need it
+START_TEST(test_batch) {
+    int count = 300;
+    size_t sizes[300], offsets[301], restored_offsets[301];
+    uchar* records[300];
+    size_t independent_size = 0, total = 0;
+    huffman_options options;
+    huffman_default_options(&options);
+
+    for(int i = 0; i < count; ++i) {
+        sizes[i] = i % 50 == 0 ? 0 : 200 + rand() % 1000;
+        records[i] = (uchar*) malloc(sizes[i] + 1);
+        for(size_t j = 0; j < sizes[i]; ++j)
+            records[i][j] = rand() % 4 ? 'a' + rand() % 6 : ' ';
+        total += sizes[i];
+    }
+    size_t bound = huffman_compress_batch_bound(sizes, count);
+    uchar* output = (uchar*) malloc(bound);
+    uchar* restored = (uchar*) malloc(total);
+
+    for(int shared = 0; shared < 2; ++shared) {
+        options.batch_table = shared;
+        ck_assert_int_eq(huffman_compress_batch(records, sizes, count,
+                    output, bound, offsets, &options), 1);
+        ck_assert_int_eq(offsets[0] > 0, shared);
+        ck_assert_int_eq(offsets[1], offsets[0]); // empty record
+        ck_assert_int_eq(huffman_decompressed_size_batch(output, offsets,
+                    count), total);
+        ck_assert_int_eq(huffman_decompress_batch(output, offsets, count,
+                    restored, total, restored_offsets), 1);
+        for(int i = 0; i < count; ++i) {
+            ck_assert_int_eq(restored_offsets[i + 1] - restored_offsets[i],
+                    sizes[i]);
+            ck_assert(memcmp(records[i], restored + restored_offsets[i],
+                        sizes[i]) == 0);
+        }
+        // too little space for either side
+        ck_assert_int_eq(huffman_decompress_batch(output, offsets, count,
+                    restored, total - 1, restored_offsets), 0);
+        ck_assert_int_eq(huffman_compress_batch(records, sizes, count,
+                    output, offsets[count] - 1, offsets, &options), 0);
+
+        if(!shared) {
+            independent_size = offsets[count];
+        } else {
+            ck_assert_int_lt(offsets[count], independent_size);
+            // a record of the batch can't be read without its table
+            size_t restored_size;
+            ck_assert_int_eq(huffman_decompress_to(output + offsets[1],
+                        offsets[2] - offsets[1], restored, total,
+                        &restored_size), 0);
+        }
+    }
+    for(int i = 0; i < count; ++i)
+        free(records[i]);
+    free(output);
+    free(restored);
+} END_TEST
+
+
+// every kernel set the CPU has writes and reads the same bytes
+START_TEST(test_kernels) {
+    kernel_set selected = kernels;
+    kernel_set sets[3];
+    int set_count = 0;
+    sets[set_count++] = kernels;
+#ifdef KERNEL_DISPATCH
+    int features = cpu_features();
+    if(features & CPU_BMI2)
+        sets[set_count++] = bmi2_kernels;
+    if((features & CPU_AVX2) && (features & CPU_BMI2))
+        sets[set_count++] = avx2_kernels;
+#endif
+    ck_assert_str_eq(huffman_kernels(), selected.name);
+
+    size_t size = 300000;
+    uchar* input = (uchar*) malloc(size);
+    for(size_t i = 0; i < size; ++i) // runs, then text-like bytes
+        input[i] = i < size / 4 ? 'a' + (i / (1 + i % 7)) % 3 :
+            rand() % 4 ? 'a' + rand() % 20 : ' ';
+    size_t bound = huffman_compress_bound(size);
+    uchar* expected = (uchar*) malloc(bound);
+    uchar* output = (uchar*) malloc(bound);
+    uchar* restored = (uchar*) malloc(size);
+    huffman_options options;
+    huffman_default_options(&options);
+
+    // every set codes the same bytes and reads the bytes of the others
+    for(int interleaved = 0; interleaved < 2; ++interleaved) {
+        options.interleaved = interleaved;
+        size_t expected_size, outsize, restored_size;
+        kernels = sets[0];
+        ck_assert_int_eq(huffman_compress_to(input, size, expected, bound,
+                    &expected_size, &options), 1);
+        for(int k = 0; k < set_count; ++k) {
+            kernels = sets[k];
+            ck_assert_int_eq(huffman_compress_to(input, size, output, bound,
+                        &outsize, &options), 1);
+            ck_assert_int_eq(outsize, expected_size);
+            ck_assert(memcmp(output, expected, outsize) == 0);
+            ck_assert_int_eq(huffman_decompress_to(expected, expected_size,
+                        restored, size, &restored_size), 1);
+            ck_assert(memcmp(restored, input, size) == 0);
+        }
+    }
+
+    for(int k = 0; k < set_count; ++k) {
+        for(int i = 0; i < 200; ++i) {
+            size_t offset = rand() % 1000, length = rand() % 2000;
+            uint64_t counts[256], generic_counts[256];
+            ck_assert_int_eq(sets[k].count_runs(input + offset, length),
+                    count_runs_generic(input + offset, length));
+            memset(counts, 0, sizeof(counts));
+            memset(generic_counts, 0, sizeof(generic_counts));
+            sets[k].count_chunk(input + offset, length, counts);
+            count_chunk_generic(input + offset, length, generic_counts);
+            ck_assert(memcmp(counts, generic_counts, sizeof(counts)) == 0);
+        }
+    }
+    kernels = selected;
+    free(input);
+    free(expected);
+    free(output);
+    free(restored);
+} END_TEST
+
+
 
 
 Suite * huffman_suite(void)
@@ -269,15 +916,30 @@ s = suite_create("Huffman");
     tcase_set_timeout(tc_core, 0);
     tcase_add_test(tc_core, test_original_size);
     tcase_add_test(tc_core, test_code_write);
-    tcase_add_test(tc_core, test_trees_equal);
+    tcase_add_test(tc_core, test_lengths_equal);
+    tcase_add_test(tc_core, test_canonical_codes);
     tcase_add_test(tc_core, test_compress_decompress);
     tcase_add_test(tc_core, test_frequencies);
+    tcase_add_test(tc_core, test_count_symbols);
     tcase_add_test(tc_core, test_big_data);
     tcase_add_test(tc_core, test_one_symbol);
+    tcase_add_test(tc_core, test_long_codes);
+    tcase_add_test(tc_core, test_limit_optimal);
+    tcase_add_test(tc_core, test_interleaved);
+    tcase_add_test(tc_core, test_compress_bound);
+    tcase_add_test(tc_core, test_block_modes);
+    tcase_add_test(tc_core, test_stats);
+    tcase_add_test(tc_core, test_varint);
+    tcase_add_test(tc_core, test_codebook);
     tcase_add_test(tc_core, test_compress_null);
     tcase_add_test(tc_core, test_decompress_null);
     tcase_add_test(tc_core, test_zero_size);
     tcase_add_test(tc_core, test_bad_insize_pointer);
+    tcase_add_test(tc_core, test_context_tables);
+    tcase_add_test(tc_core, test_wide);
+    tcase_add_test(tc_core, test_truncated);
+    tcase_add_test(tc_core, test_batch);
+    tcase_add_test(tc_core, test_kernels);
 
     suite_add_tcase(s, tc_core);
     return s;
@@ -0,0 +1,180 @@
+#include <check.h>
+#include "../heap.c"
+#include "../huffman.c"
+#include "../pool.c"
+#include "../block_index.c"
+#include "../stream.c"
+#include "../pipeline.c"
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct {
+    uchar* data;
+    size_t size;
+    size_t capacity;
+} buffer;
+
+typedef struct {
+    const uchar* data;
+    size_t size;
+    size_t offset;
+} source;
+
+int write_buffer(void* opaque, const uchar* data, size_t size) {
+    buffer* buf = (buffer*) opaque;
+    if(buf->size + size > buf->capacity) {
+        buf->capacity = (buf->size + size) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 1;
+}
+
+int failing_write(void* opaque, const uchar* data, size_t size) {
+    return 0;
+}
+
+// gives the data by chunks of random size, like a pipe
+int read_source(void* opaque, uchar* data, size_t size, size_t* read) {
+    source* src = (source*) opaque;
+    size_t chunk = 1 + rand() % 5000;
+    chunk = chunk < size ? chunk : size;
+    chunk = chunk < src->size - src->offset ? chunk : src->size - src->offset;
+    if(chunk)
+        memcpy(data, src->data + src->offset, chunk);
+    src->offset += chunk;
+    *read = chunk;
+    return 1;
+}
+
+int failing_read(void* opaque, uchar* data, size_t size, size_t* read) {
+    return 0;
+}
+
+uchar* sample(int size) {
+    uchar* input = (uchar*) malloc(size);
+    for(int i = 0; i < size; ++i)
+        input[i] = (i % 7) * (i % 13) + rand() % 4;
+    return input;
+}
+
+
+// the pipeline gives the stream format and reads it back
+START_TEST(test_pipe_round_trip) {
+    int size = 300000;
+    uchar* input = sample(size);
+    huffman_options options;
+    huffman_default_options(&options);
+    options.block_size = 7000;
+
+    for(int threads = 1; threads <= 4; threads += 3) {
+        options.threads = threads;
+        options.seekable = threads > 1; // the index is read back too
+        buffer compressed = { NULL, 0, 0 }, decompressed = { NULL, 0, 0 };
+        source src = { input, size, 0 };
+        ck_assert_int_eq(huffman_compress_pipe(&options, read_source, &src,
+                    write_buffer, &compressed), 1);
+
+        size_t comp_size;
+        uchar* expected = huffman_compress_parallel(input, size, &comp_size,
+                &options);
+        ck_assert_int_eq(compressed.size, comp_size);
+        ck_assert_msg(memcmp(compressed.data, expected, comp_size) == 0,
+                "pipeline differs from the stream format");
+
+        source packed = { compressed.data, compressed.size, 0 };
+        ck_assert_int_eq(huffman_decompress_pipe(&options, read_source,
+                    &packed, write_buffer, &decompressed), 1);
+        ck_assert_int_eq(decompressed.size, size);
+        ck_assert_msg(memcmp(decompressed.data, input, size) == 0,
+                "original data recovered incorrectly");
+
+        free(expected);
+        free(compressed.data);
+        free(decompressed.data);
+    }
+    free(input);
+} END_TEST
+
+
+// empty input is the end marker alone
+START_TEST(test_pipe_empty) {
+    buffer compressed = { NULL, 0, 0 }, decompressed = { NULL, 0, 0 };
+    source src = { NULL, 0, 0 };
+    ck_assert_int_eq(huffman_compress_pipe(NULL, read_source, &src,
+                write_buffer, &compressed), 1);
+    ck_assert_int_eq(compressed.size, 4);
+
+    source packed = { compressed.data, compressed.size, 0 };
+    ck_assert_int_eq(huffman_decompress_pipe(NULL, read_source, &packed,
+                write_buffer, &decompressed), 1);
+    ck_assert_int_eq(decompressed.size, 0);
+    free(compressed.data);
+} END_TEST
+
+
+// broken streams and failing callbacks are reported
+START_TEST(test_pipe_failures) {
+    int size = 50000;
+    uchar* input = sample(size);
+    huffman_options options;
+    huffman_default_options(&options);
+    options.block_size = 1000;
+    options.threads = 2;
+
+    buffer compressed = { NULL, 0, 0 }, decompressed = { NULL, 0, 0 };
+    source src = { input, size, 0 };
+    ck_assert_int_eq(huffman_compress_pipe(&options, read_source, &src,
+                write_buffer, &compressed), 1);
+
+    // truncated
+    source packed = { compressed.data, compressed.size - 1, 0 };
+    ck_assert_int_eq(huffman_decompress_pipe(&options, read_source, &packed,
+                write_buffer, &decompressed), 0);
+    // data after the end marker
+    write_buffer(&compressed, "x", 1);
+    source trailing = { compressed.data, compressed.size, 0 };
+    ck_assert_int_eq(huffman_decompress_pipe(&options, read_source,
+                &trailing, write_buffer, &decompressed), 0);
+
+    src.offset = 0;
+    ck_assert_int_eq(huffman_compress_pipe(&options, read_source, &src,
+                failing_write, NULL), 0);
+    ck_assert_int_eq(huffman_compress_pipe(&options, failing_read, NULL,
+                write_buffer, &compressed), 0);
+
+    options.context_tables = HUFFMAN_MAX_CONTEXT_TABLES + 1;
+    ck_assert_int_eq(huffman_compress_pipe(&options, read_source, &src,
+                write_buffer, &compressed), 0);
+    options.context_tables = 0;
+    options.block_size = 0;
+    ck_assert_int_eq(huffman_compress_pipe(&options, read_source, &src,
+                write_buffer, &compressed), 0);
+    ck_assert_int_eq(huffman_compress_pipe(NULL, NULL, NULL, write_buffer,
+                NULL), 0);
+
+    free(input);
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+int main(void)
+{
+    Suite *s = suite_create("pipeline");
+    TCase *tc = tcase_create("pipeline");
+    SRunner *sr = srunner_create(s);
+    int nf;
+
+    suite_add_tcase(s, tc);
+    tcase_add_test(tc, test_pipe_round_trip);
+    tcase_add_test(tc, test_pipe_empty);
+    tcase_add_test(tc, test_pipe_failures);
+
+    srunner_run_all(sr, CK_ENV);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return nf == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
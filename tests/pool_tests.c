@@ -0,0 +1,57 @@
+#include <check.h>
+#include "../pool.h"
+#include "../pool.c"
+
+void square(void* context, int index) {
+    int* values = (int*) context;
+    values[index] = index * index;
+}
+
+START_TEST(test_all_jobs_run) {
+    worker_pool* pool = pool_create(4);
+    int values[1000];
+
+    for(int batch = 0; batch < 10; ++batch) {
+        memset(values, 0xff, sizeof(values));
+        pool_run(pool, square, values, 1000);
+        for(int i = 0; i < 1000; ++i)
+            ck_assert_int_eq(values[i], i * i);
+    }
+    pool_destroy(pool);
+} END_TEST
+
+
+START_TEST(test_single_thread_has_no_pool) {
+    int values[10];
+    ck_assert_ptr_eq(pool_create(1), NULL);
+
+    pool_run(NULL, square, values, 10);
+    for(int i = 0; i < 10; ++i)
+        ck_assert_int_eq(values[i], i * i);
+} END_TEST
+
+
+START_TEST(test_empty_batch) {
+    worker_pool* pool = pool_create(2);
+    pool_run(pool, square, NULL, 0);
+    pool_destroy(pool);
+} END_TEST
+
+int main(void)
+{
+    Suite *s = suite_create("pool");
+    TCase *tc = tcase_create("pool");
+    SRunner *sr = srunner_create(s);
+    int nf;
+
+    suite_add_tcase(s, tc);
+    tcase_add_test(tc, test_all_jobs_run);
+    tcase_add_test(tc, test_single_thread_has_no_pool);
+    tcase_add_test(tc, test_empty_batch);
+
+    srunner_run_all(sr, CK_ENV);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return nf == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,415 @@
+#include <check.h>
+#include "../heap.c"
+#include "../huffman.c"
+#include "../pool.c"
+#include "../block_index.c"
+#include "../stream.c"
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct {
+    uchar* data;
+    size_t size;
+    size_t capacity;
+} buffer;
+
+int write_buffer(void* opaque, const uchar* data, size_t size) {
+    buffer* buf = (buffer*) opaque;
+    if(buf->size + size > buf->capacity) {
+        buf->capacity = (buf->size + size) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 1;
+}
+
+int failing_write(void* opaque, const uchar* data, size_t size) {
+    return 0;
+}
+
+uchar* sample(int size) {
+    uchar* input = (uchar*) malloc(size);
+    for(int i = 0; i < size; ++i)
+        input[i] = (i % 7) * (i % 13) + rand() % 4;
+    return input;
+}
+
+// feeds data to the stream by chunks of random size
+int feed_randomly(int (*feed)(huffman_stream*, const uchar*, size_t),
+        huffman_stream* stream, const uchar* data, size_t size) {
+    while(size > 0) {
+        int chunk = 1 + rand() % 3000;
+        chunk = chunk < size ? chunk : size;
+        if(!feed(stream, data, chunk))
+            return 0;
+        data += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+
+buffer compress_sample(uchar* input, int size, int block_size, int threads) {
+    buffer compressed = { NULL, 0, 0 };
+    huffman_options options;
+    huffman_default_options(&options);
+    options.block_size = block_size;
+    options.threads = threads;
+
+    huffman_stream* stream =
+        huffman_compress_init(&options, write_buffer, &compressed);
+    ck_assert_ptr_ne(stream, NULL);
+    ck_assert_int_eq(feed_randomly(huffman_compress_feed, stream,
+                input, size), 1);
+    ck_assert_int_eq(huffman_compress_finish(stream), 1);
+    return compressed;
+}
+
+
+// equivalence of original and decompressed data
+START_TEST(test_stream_round_trip) {
+    int size = 100000;
+    uchar* input = sample(size);
+    buffer compressed = compress_sample(input, size, 4096, 1);
+    buffer decompressed = { NULL, 0, 0 };
+
+    huffman_stream* stream = huffman_decompress_init(NULL, write_buffer,
+            &decompressed);
+    ck_assert_int_eq(feed_randomly(huffman_decompress_feed, stream,
+                compressed.data, compressed.size), 1);
+    ck_assert_int_eq(huffman_decompress_finish(stream), 1);
+
+    ck_assert_int_eq(decompressed.size, size);
+    ck_assert_msg(memcmp(decompressed.data, input, size) == 0,
+            "original data recovered incorrectly");
+
+    free(input);
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+// flush closes the current block
+START_TEST(test_stream_flush) {
+    buffer compressed = { NULL, 0, 0 }, decompressed = { NULL, 0, 0 };
+    uchar* input = "aaaaaaaaaabbbbbbbbcccccccdddddd";
+
+    huffman_stream* stream = huffman_compress_init(NULL, write_buffer,
+            &compressed);
+    huffman_compress_feed(stream, input, 10);
+    ck_assert_int_eq(huffman_compress_flush(stream), 1);
+    int flushed = compressed.size;
+    ck_assert_int_gt(flushed, 0);
+    huffman_compress_feed(stream, input + 10, strlen(input) - 10);
+    ck_assert_int_eq(huffman_compress_finish(stream), 1);
+
+    stream = huffman_decompress_init(NULL, write_buffer, &decompressed);
+    // first block can be decompressed on its own
+    ck_assert_int_eq(huffman_decompress_feed(stream, compressed.data,
+                flushed), 1);
+    ck_assert_int_eq(decompressed.size, 10);
+    huffman_decompress_feed(stream, compressed.data + flushed,
+            compressed.size - flushed);
+    ck_assert_int_eq(huffman_decompress_finish(stream), 1);
+    ck_assert_int_eq(decompressed.size, strlen(input));
+    ck_assert_msg(memcmp(decompressed.data, input, strlen(input)) == 0,
+            "original data recovered incorrectly");
+
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+// stream without the end marker is incomplete
+START_TEST(test_stream_truncated) {
+    int size = 10000;
+    uchar* input = sample(size);
+    buffer compressed = compress_sample(input, size, 1000, 1);
+    buffer decompressed = { NULL, 0, 0 };
+
+    huffman_stream* stream = huffman_decompress_init(NULL, write_buffer,
+            &decompressed);
+    huffman_decompress_feed(stream, compressed.data, compressed.size - 1);
+    ck_assert_int_eq(huffman_decompress_finish(stream), 0);
+
+    free(input);
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+// nothing but the index is accepted after the end marker
+START_TEST(test_stream_trailing_data) {
+    buffer compressed = compress_sample("abcabcabc", 9, 1000, 1);
+    buffer decompressed = { NULL, 0, 0 };
+    write_buffer(&compressed, "x", 1);
+
+    huffman_stream* stream = huffman_decompress_init(NULL, write_buffer,
+            &decompressed);
+    int fed = huffman_decompress_feed(stream, compressed.data,
+            compressed.size);
+    ck_assert_int_eq(huffman_decompress_finish(stream) && fed, 0);
+
+    // longer than any index of a single block
+    for(int i = 0; i < 20; ++i)
+        write_buffer(&compressed, "x", 1);
+    stream = huffman_decompress_init(NULL, write_buffer, &decompressed);
+    ck_assert_int_eq(huffman_decompress_feed(stream, compressed.data,
+                compressed.size), 0);
+    huffman_decompress_finish(stream);
+
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+// errors of the output callback are reported
+START_TEST(test_stream_write_failure) {
+    huffman_stream* stream = huffman_compress_init(NULL, failing_write, NULL);
+    ck_assert_int_eq(huffman_compress_feed(stream, "abc", 3), 1);
+    ck_assert_int_eq(huffman_compress_finish(stream), 0);
+} END_TEST
+
+
+// multi-threaded streams give the same data
+START_TEST(test_stream_threads) {
+    int size = 300000;
+    uchar* input = sample(size);
+    buffer compressed = compress_sample(input, size, 5000, 4);
+    buffer decompressed = { NULL, 0, 0 };
+    huffman_options options;
+    huffman_default_options(&options);
+    options.threads = 3;
+
+    huffman_stream* stream = huffman_decompress_init(&options, write_buffer,
+            &decompressed);
+    ck_assert_int_eq(feed_randomly(huffman_decompress_feed, stream,
+                compressed.data, compressed.size), 1);
+    ck_assert_int_eq(huffman_decompress_finish(stream), 1);
+
+    ck_assert_int_eq(decompressed.size, size);
+    ck_assert_msg(memcmp(decompressed.data, input, size) == 0,
+            "original data recovered incorrectly");
+
+    free(input);
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+// whole buffer is compressed by parallel blocks into the stream format
+START_TEST(test_parallel) {
+    int size = 1000000;
+    size_t comp_size, decomp_size;
+    uchar* input = sample(size);
+    huffman_options options;
+    huffman_default_options(&options);
+    options.block_size = 100000;
+    options.threads = 4;
+
+    uchar* output = huffman_compress_parallel(input, size, &comp_size,
+            &options);
+    buffer streamed = compress_sample(input, size, 100000, 1);
+    ck_assert_int_eq(comp_size, streamed.size);
+    ck_assert_msg(memcmp(output, streamed.data, comp_size) == 0,
+            "parallel compression differs from the stream");
+
+    uchar* decompressed = huffman_decompress_parallel(output, comp_size,
+            &decomp_size, &options);
+    ck_assert_int_eq(decomp_size, size);
+    ck_assert_msg(memcmp(decompressed, input, size) == 0,
+            "original data recovered incorrectly");
+
+    // truncated data is rejected
+    ck_assert_ptr_eq(huffman_decompress_parallel(output, comp_size - 1,
+                &decomp_size, &options), NULL);
+
+    // same into caller buffers
+    size_t bound = huffman_compress_parallel_bound(size, &options), to_size;
+    uchar* to = (uchar*) malloc(bound);
+    ck_assert_int_eq(huffman_compress_parallel_to(input, size, to, bound,
+                &to_size, &options), 1);
+    ck_assert_int_eq(to_size, comp_size);
+    ck_assert(memcmp(to, output, comp_size) == 0);
+    ck_assert_int_eq(huffman_compress_parallel_to(input, size, to, bound - 1,
+                &to_size, &options), 0);
+
+    ck_assert_int_eq(huffman_decompress_parallel_size(output, comp_size,
+                &to_size), 1);
+    ck_assert_int_eq(to_size, size);
+    memset(to, 0, size);
+    ck_assert_int_eq(huffman_decompress_parallel_to(output, comp_size, to,
+                size, &to_size, &options), 1);
+    ck_assert(memcmp(to, input, size) == 0);
+    ck_assert_int_eq(huffman_decompress_parallel_to(output, comp_size, to,
+                size - 1, &to_size, &options), 0);
+    free(to);
+
+    free(input);
+    free(output);
+    free(decompressed);
+    free(streamed.data);
+} END_TEST
+
+
+// seekable streams are read as a whole or by ranges of the data
+START_TEST(test_seekable) {
+    int size = 100000;
+    uchar* input = sample(size);
+    huffman_options options;
+    huffman_default_options(&options);
+    options.block_size = 7000;
+    options.threads = 3;
+    options.seekable = 1;
+
+    // the index is the same in both producers
+    buffer streamed = { NULL, 0, 0 }, decompressed = { NULL, 0, 0 };
+    huffman_stream* stream = huffman_compress_init(&options, write_buffer,
+            &streamed);
+    ck_assert_int_eq(huffman_compress_feed(stream, input, size), 1);
+    ck_assert_int_eq(huffman_compress_finish(stream), 1);
+    size_t comp_size, data_size;
+    uchar* compressed = huffman_compress_parallel(input, size, &comp_size,
+            &options);
+    ck_assert_int_eq(streamed.size, comp_size);
+    ck_assert(memcmp(streamed.data, compressed, comp_size) == 0);
+    ck_assert_int_le(comp_size, huffman_compress_parallel_bound(size,
+                &options));
+
+    // plain readers skip the index
+    stream = huffman_decompress_init(&options, write_buffer, &decompressed);
+    ck_assert_int_eq(feed_randomly(huffman_decompress_feed, stream,
+                compressed, comp_size), 1);
+    ck_assert_int_eq(huffman_decompress_finish(stream), 1);
+    ck_assert_int_eq(decompressed.size, size);
+    uchar* restored = huffman_decompress_parallel(compressed, comp_size,
+            &data_size, &options);
+    ck_assert_ptr_ne(restored, NULL);
+    ck_assert(memcmp(restored, input, size) == 0);
+
+    ck_assert_int_eq(huffman_seekable_size(compressed, comp_size,
+                &data_size), 1);
+    ck_assert_int_eq(data_size, size);
+    for(int i = 0; i < 200; ++i) {
+        size_t offset = rand() % size;
+        size_t length = i == 0 ? size - offset : rand() % (size - offset);
+        memset(restored, 0, size);
+        ck_assert_int_eq(huffman_decompress_range(compressed, comp_size,
+                    offset, length, restored, &options), 1);
+        ck_assert(memcmp(restored, input + offset, length) == 0);
+    }
+    ck_assert_int_eq(huffman_decompress_range(compressed, comp_size, 0,
+                size + 1, restored, &options), 0);
+
+    // blocks before the range aren't read at all
+    compressed[0] ^= 1;
+    ck_assert_int_eq(huffman_decompress_range(compressed, comp_size,
+                size - 10, 10, restored, &options), 1);
+    ck_assert(memcmp(restored, input + size - 10, 10) == 0);
+    ck_assert_int_eq(huffman_decompress_range(compressed, comp_size, 0,
+                10, restored, &options), 0);
+    compressed[0] ^= 1;
+
+    // streams without the index aren't seekable
+    ck_assert_int_eq(huffman_seekable_size(streamed.data,
+                comp_size - 1, &data_size), 0);
+    compressed[comp_size - 1] ^= 1;
+    ck_assert_int_eq(huffman_decompress_range(compressed, comp_size, 0,
+                10, restored, &options), 0);
+    ck_assert_ptr_eq(huffman_decompress_parallel(compressed, comp_size,
+                &data_size, &options), NULL);
+
+    free(input);
+    free(compressed);
+    free(restored);
+    free(streamed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+// invalid options are rejected
+START_TEST(test_stream_bad_options) {
+    huffman_options options;
+    huffman_default_options(&options);
+    options.block_size = 0;
+    ck_assert_ptr_eq(huffman_compress_init(&options, write_buffer, NULL),
+            NULL);
+    options.block_size = HUFFMAN_MAX_BLOCK_SIZE + 1;
+    ck_assert_ptr_eq(huffman_compress_init(&options, write_buffer, NULL),
+            NULL);
+    options.block_size = HUFFMAN_DEFAULT_BLOCK_SIZE;
+    options.context_tables = HUFFMAN_MAX_CONTEXT_TABLES + 1;
+    ck_assert_ptr_eq(huffman_compress_init(&options, write_buffer, NULL),
+            NULL);
+    options.context_tables = 0;
+    options.threads = 0;
+    ck_assert_ptr_eq(huffman_compress_init(&options, write_buffer, NULL),
+            NULL);
+    ck_assert_ptr_eq(huffman_compress_init(NULL, NULL, NULL), NULL);
+    ck_assert_ptr_eq(huffman_decompress_init(NULL, NULL, NULL), NULL);
+} END_TEST
+
+
+// blocks waiting for a batch of the threads are written by flush
+START_TEST(test_decompress_flush) {
+    buffer compressed = { NULL, 0, 0 }, decompressed = { NULL, 0, 0 };
+    uchar* input = "aaaaaaaaaabbbbbbbbcccccccdddddd";
+    huffman_options options;
+    huffman_default_options(&options);
+    options.threads = 4;
+
+    huffman_stream* stream = huffman_compress_init(&options, write_buffer,
+            &compressed);
+    huffman_compress_feed(stream, input, 10);
+    ck_assert_int_eq(huffman_compress_flush(stream), 1);
+    int flushed = compressed.size;
+    huffman_compress_feed(stream, input + 10, strlen(input) - 10);
+    ck_assert_int_eq(huffman_compress_finish(stream), 1);
+
+    // the first block and a part of the second one
+    stream = huffman_decompress_init(&options, write_buffer, &decompressed);
+    ck_assert_int_eq(huffman_decompress_feed(stream, compressed.data,
+                flushed + 6), 1);
+    ck_assert_int_eq(decompressed.size, 0);
+    ck_assert_int_eq(huffman_decompress_flush(stream), 1);
+    ck_assert_int_eq(decompressed.size, 10);
+    ck_assert_int_eq(huffman_decompress_flush(stream), 1);
+    ck_assert_int_eq(decompressed.size, 10);
+
+    ck_assert_int_eq(huffman_decompress_feed(stream, compressed.data +
+                flushed + 6, compressed.size - flushed - 6), 1);
+    ck_assert_int_eq(huffman_decompress_finish(stream), 1);
+    ck_assert_int_eq(decompressed.size, strlen(input));
+    ck_assert(memcmp(decompressed.data, input, strlen(input)) == 0);
+    ck_assert_int_eq(huffman_decompress_flush(NULL), 0);
+
+    free(compressed.data);
+    free(decompressed.data);
+} END_TEST
+
+
+int main(void)
+{
+    Suite *s = suite_create("stream");
+    TCase *tc = tcase_create("stream");
+    SRunner *sr = srunner_create(s);
+    int nf;
+
+    suite_add_tcase(s, tc);
+    tcase_add_test(tc, test_stream_round_trip);
+    tcase_add_test(tc, test_stream_flush);
+    tcase_add_test(tc, test_stream_truncated);
+    tcase_add_test(tc, test_stream_trailing_data);
+    tcase_add_test(tc, test_stream_write_failure);
+    tcase_add_test(tc, test_stream_threads);
+    tcase_add_test(tc, test_parallel);
+    tcase_add_test(tc, test_seekable);
+    tcase_add_test(tc, test_stream_bad_options);
+    tcase_add_test(tc, test_decompress_flush);
+
+    srunner_run_all(sr, CK_ENV);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return nf == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}